@@ -1,17 +1,57 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
+// * To start reading a block that will be needed soon, call
+//     breadahead; it does not wait and leaves the buffer unlocked.
+// * To write many buffers at once, call bstartwritev on all of
+//     them and then bwait on each, instead of bwrite.  bflush
+//     makes completed writes durable.
+// * To have requests started one at a time go to the disk together,
+//     bracket them with bplug and bunplug.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets, each
+// with its own spin-lock protecting the bucket list and the
+// refcnt of the buffers on it.  A lookup that hits only takes the
+// lock of one bucket.  A miss takes bcache.lock, which serializes
+// evictions (but not hits), and steals the least recently released
+// unreferenced buffer from whichever bucket holds it.
+//
+// Replacement follows 2Q, so that one pass over a large file does
+// not flush the blocks everyone keeps coming back to.  A data block
+// read for the first time goes on the probationary queue (probe == 1),
+// which is evicted in FIFO order and kept to about a quarter of the
+// cache.  A block evicted from there is remembered in the ghost
+// queue; missing on it again shows it is reused, so it comes back
+// on the hot queue (probe == 0), which is evicted in LRU order.
+// Metadata blocks (superblock, log header, inodes, bitmap) go
+// straight to the hot queue.
+//
+// Buffer data lives in pages from kalloc(), BPP buffers to a page.
+// The cache starts with NBUF buffers and grows a page at a time on
+// misses, up to NBUFMAX.  When kalloc() runs out of memory it calls
+// bshrink() to take back pages whose buffers are all unreferenced.
+//
+// Reads and writes go through a request queue per device, kept
+// sorted by block number. bdispatch() hands the whole queue to the
+// disk, merging runs of consecutive blocks in the same direction
+// into one request of up to BMAXRUN blocks, and going through the
+// runs in one sweep up from where the last dispatch left off
+// (C-LOOK). A request is dispatched as soon as it is queued unless
+// the queue is plugged; bwait() dispatches the queue before it
+// waits, so a plugged request is never stranded. Since every
+// dispatch empties the queue, no request waits behind others for
+// long, and there is no need for deadlines.
 
 
 #include "types.h"
@@ -23,32 +63,323 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13
+#define BPP     (PGSIZE/BSIZE)      // buffers per page
+#define NBPAGE  ((NBUFMAX+BPP-1)/BPP)
+#define NGHOST  (NBUFMAX/2)         // max size of ghost queue
+#define BMAXRUN 32                  // max blocks per disk request
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head;   // circular list through prev/next
+};
+
+struct {
+  struct spinlock lock; // serializes eviction; protects free, page, nbuf
+  struct buf buf[NBPAGE*BPP];
+  struct bucket bucket[NBUCKET];
+
+  // Buffers that hold no block yet, through prev/next.
+  struct buf free;
+
+  // page[i] holds the data of buf[i*BPP] .. buf[i*BPP+BPP-1],
+  // or is 0 if those buffers are not in use.
+  char *page[NBPAGE];
+  int nbuf;
+
+  int nprobe;          // buffers on the probationary queue
+  uint stamp;          // source of lastuse stamps
+
+  // Ghost queue: ring of recently evicted probationary blocks.
+  struct {
+    uint dev;
+    uint blockno;
+  } ghost[NGHOST];
+  int ghead;           // next slot to overwrite
+  int nghost;
+
+  // Hits and misses in bget(), by block class.
+  uint hits[NBCLASS];
+  uint misses[NBCLASS];
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  // Read-ahead: blocks started, found by bread(), found by bread()
+  // while still in flight, and evicted without ever being used.
+  uint raissued;
+  uint rahits;
+  uint ralate;
+  uint rawasted;
 } bcache;
 
+struct bqueue {
+  struct spinlock lock;
+  struct buf *head;    // queued bufs, sorted by blockno, through dnext
+  int plug;            // queue without dispatching while > 0
+  uint pos;            // block after the last run dispatched
+  uint nbuf;           // bufs dispatched
+  uint nreq;           // disk requests they took
+  uint ndiscard;       // blocks discarded
+} bqueue[NDISK];
+
+static char *bcname[NBCLASS] = {
+[BC_DATA]    "data",
+[BC_SUPER]   "super",
+[BC_LOGHDR]  "log header",
+[BC_LOG]     "log",
+[BC_INODE]   "inode",
+[BC_BITMAP]  "bitmap",
+};
+
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Unlink b from its bucket or free list.
+// Caller holds the bucket lock or bcache.lock respectively.
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Link b at the front of bucket bk.  Caller holds bk->lock.
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Give the buffers of page slot i their data in pa and put
+// them on the free list.  Caller holds bcache.lock.
+static void
+bmapage(int i, char *pa)
+{
+  struct buf *b;
+
+  bcache.page[i] = pa;
+  for(b = &bcache.buf[i*BPP]; b < &bcache.buf[(i+1)*BPP]; b++){
+    b->data = (uchar*)pa + (b - &bcache.buf[i*BPP]) * BSIZE;
+    b->refcnt = 0;
+    b->lastuse = 0;
+    b->ra = 0;
+    b->next = bcache.free.next;
+    b->prev = &bcache.free;
+    bcache.free.next->prev = b;
+    bcache.free.next = b;
+  }
+  bcache.nbuf += BPP;
+}
+
+// Add a page of buffers to the cache.
+// Returns 0 if the cache is at NBUFMAX or memory is short.
+static int
+bgrow(void)
+{
+  char *pa;
+  int i;
+
+  if((pa = kalloc()) == 0)
+    return 0;
+  acquire(&bcache.lock);
+  for(i = 0; i < NBPAGE; i++){
+    if(bcache.page[i] == 0){
+      bmapage(i, pa);
+      release(&bcache.lock);
+      return 1;
+    }
+  }
+  release(&bcache.lock);
+  kfree(pa);
+  return 0;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+  int i;
 
   initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  bcache.free.prev = &bcache.free;
+  bcache.free.next = &bcache.free;
+  for(b = bcache.buf; b < bcache.buf+NBPAGE*BPP; b++)
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(i = 0; i < NDISK; i++)
+    initlock(&bqueue[i].lock, "bqueue");
+
+  while(bcache.nbuf < NBUF)
+    if(bgrow() == 0)
+      panic("binit");
+}
+
+// Hand back to kalloc() up to npages pages whose buffers are
+// all unreferenced, never shrinking the cache below NBUF.
+// Returns the number of pages freed.
+int
+bshrink(int npages)
+{
+  struct buf *b;
+  struct bucket *bk;
+  char *freed[NBPAGE];
+  int i, n;
+
+  n = 0;
+  acquire(&bcache.lock);
+  // With every bucket locked no refcnt can change.  Nobody else
+  // holds more than one bucket lock without bcache.lock.
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    acquire(&bk->lock);
+  for(i = NBPAGE-1; i >= 0 && n < npages && bcache.nbuf-BPP >= NBUF; i--){
+    if(bcache.page[i] == 0)
+      continue;
+    for(b = &bcache.buf[i*BPP]; b < &bcache.buf[(i+1)*BPP]; b++)
+      if(b->refcnt != 0)
+        break;
+    if(b < &bcache.buf[(i+1)*BPP])
+      continue;
+    for(b = &bcache.buf[i*BPP]; b < &bcache.buf[(i+1)*BPP]; b++){
+      b->next->prev = b->prev;
+      b->prev->next = b->next;
+      b->data = 0;
+      if(b->probe){
+        b->probe = 0;
+        bcache.nprobe--;
+      }
+    }
+    freed[n++] = bcache.page[i];
+    bcache.page[i] = 0;
+    bcache.nbuf -= BPP;
   }
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    release(&bk->lock);
+  release(&bcache.lock);
+
+  for(i = 0; i < n; i++)
+    kfree(freed[i]);
+  return n;
+}
+
+// Look for block on device dev in bucket bk, which must be locked.
+// On a hit, take a reference and return the buffer.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Find the unreferenced buffer with the oldest lastuse on the
+// probationary (probe == 1) or hot (probe == 0) queue and unlink it
+// from its bucket.  Caller holds bcache.lock.
+static struct buf*
+bevictq(int probe)
+{
+  struct buf *b, *victim;
+  struct bucket *bk, *vbk;
+
+  victim = 0;
+  vbk = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    acquire(&bk->lock);
+    int found = 0;
+    for(b = bk->head.next; b != &bk->head; b = b->next){
+      if(b->refcnt == 0 && b->probe == probe &&
+         (victim == 0 || (int)(b->lastuse - victim->lastuse) < 0)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(!found){
+      release(&bk->lock);
+      continue;
+    }
+    // Keep the bucket of the best candidate so far locked,
+    // so that its refcnt cannot change under us.
+    if(vbk)
+      release(&vbk->lock);
+    vbk = bk;
+  }
+  if(victim == 0)
+    return 0;
+
+  bunlink(victim);
+  victim->refcnt = 1;
+  release(&vbk->lock);
+  return victim;
+}
+
+// Pick a buffer to reuse: a free one if there is one, else one
+// from the probationary queue if it is over its share of the
+// cache, else the least recently used hot one.
+// Caller holds bcache.lock.
+static struct buf*
+bevict(void)
+{
+  struct buf *b;
+  int probe;
+
+  if(bcache.free.next != &bcache.free){
+    b = bcache.free.next;
+    bunlink(b);
+    b->refcnt = 1;
+    return b;
+  }
+
+  probe = bcache.nprobe > bcache.nbuf/4;
+  if((b = bevictq(probe)) == 0 && (b = bevictq(!probe)) == 0)
+    return 0;
+  if(b->ra){
+    b->ra = 0;
+    bcache.rawasted++;
+  }
+  if(b->probe){
+    // Remember it, in case it turns out to be reused.
+    b->probe = 0;
+    bcache.nprobe--;
+    bcache.ghost[bcache.ghead].dev = b->dev;
+    bcache.ghost[bcache.ghead].blockno = b->blockno;
+    bcache.ghead = (bcache.ghead + 1) % NGHOST;
+    if(bcache.nghost < NGHOST)
+      bcache.nghost++;
+  }
+  return b;
+}
+
+// Was block blockno of dev recently evicted from the probationary
+// queue?  If so, forget it.  Caller holds bcache.lock.
+static int
+bghost(uint dev, uint blockno)
+{
+  int i, n, lim;
+
+  // Only remember as many blocks as half the current cache.
+  lim = bcache.nbuf/2;
+  for(n = 0; n < bcache.nghost && n < lim; n++){
+    i = (bcache.ghead - 1 - n + NGHOST) % NGHOST;
+    if(bcache.ghost[i].dev == dev && bcache.ghost[i].blockno == blockno){
+      bcache.ghost[i].blockno = 0;  // block 0 is never cached by fs
+      return 1;
+    }
+  }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,32 +389,163 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
-
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(dev, blockno);
+  int class = blockclass(dev, blockno);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    __sync_fetch_and_add(&bcache.hits[class], 1);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached. Only evictors insert into buckets, so once we
+  // hold bcache.lock nobody else can cache the block; check
+  // again in case someone did while we were unlocked.
+  // Prefer growing the cache to evicting, while it is below
+  // NBUFMAX and kalloc() has pages to spare.
+  for(int grow = 1;; grow = bgrow()){
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+    b = bfind(bk, dev, blockno);
+    release(&bk->lock);
+    if(b){
       release(&bcache.lock);
+      __sync_fetch_and_add(&bcache.hits[class], 1);
       acquiresleep(&b->lock);
       return b;
     }
+    if(!grow || bcache.free.next != &bcache.free || bcache.nbuf >= NBUFMAX)
+      break;
+    // kalloc() may call bshrink(), so grow without bcache.lock.
+    release(&bcache.lock);
   }
 
-  // Not cached; recycle an unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Take a free buffer or recycle the least recently used one.
+  if((b = bevict()) == 0)
+    panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->lastuse = __sync_fetch_and_add(&bcache.stamp, 1);
+  if(class == BC_DATA || class == BC_LOG){
+    if(!bghost(dev, blockno)){
+      b->probe = 1;
+      bcache.nprobe++;
+    }
+  }
+  __sync_fetch_and_add(&bcache.misses[class], 1);
+  acquire(&bk->lock);
+  blink(bk, b);
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Hand dev's request queue to the disk.
+static void
+bdispatch(uint dev)
+{
+  struct bqueue *q = &bqueue[dev];
+  struct buf *b, *lo, *hi, **pp, *run[BMAXRUN];
+  uint pos, nbuf = 0, nreq = 0;
+  int n;
+
+  acquire(&q->lock);
+  lo = q->head;
+  q->head = 0;
+  pos = q->pos;
+  release(&q->lock);
+  if(lo == 0)
+    return;
+
+  // split into the blocks below the last position and the rest,
+  // and go through the rest first.
+  for(pp = &lo; *pp && (*pp)->blockno < pos; pp = &(*pp)->dnext)
+    ;
+  hi = *pp;
+  *pp = 0;
+  if(hi == 0){
+    hi = lo;
+    lo = 0;
+  }
+  for(b = hi; b; ){
+    n = 0;
+    do {
+      run[n++] = b;
+      b = b->dnext;
+    } while(b && n < BMAXRUN && b->write == run[0]->write &&
+            b->blockno == run[n-1]->blockno + 1);
+    pos = run[n-1]->blockno + 1;
+    virtio_disk_submitv(dev, run, n, run[0]->write);
+    nbuf += n;
+    nreq++;
+    if(b == 0){
+      b = lo;
+      lo = 0;
     }
   }
-  panic("bget: no buffers");
+
+  acquire(&q->lock);
+  q->pos = pos;
+  q->nbuf += nbuf;
+  q->nreq += nreq;
+  wakeup(q);  // bwait() waits for its buf to leave the queue
+  release(&q->lock);
+}
+
+// Queue a request to read (write == 0) or write b, and
+// dispatch the queue unless it is plugged.
+static void
+bsubmit(struct buf *b, int write)
+{
+  struct bqueue *q = &bqueue[b->dev];
+  struct buf **pp;
+  int plugged;
+
+  acquire(&q->lock);
+  b->disk = 2;
+  b->write = write;
+  for(pp = &q->head; *pp && (*pp)->blockno <= b->blockno; pp = &(*pp)->dnext)
+    ;
+  b->dnext = *pp;
+  *pp = b;
+  plugged = q->plug > 0;
+  release(&q->lock);
+  if(!plugged)
+    bdispatch(b->dev);
+}
+
+// Hold requests for dev in its queue until the matching bunplug(),
+// so that they can be merged and sorted.
+void
+bplug(uint dev)
+{
+  struct bqueue *q = &bqueue[dev];
+
+  acquire(&q->lock);
+  q->plug++;
+  release(&q->lock);
+}
+
+void
+bunplug(uint dev)
+{
+  struct bqueue *q = &bqueue[dev];
+  int plugged;
+
+  acquire(&q->lock);
+  if(q->plug < 1)
+    panic("bunplug");
+  plugged = --q->plug > 0;
+  release(&q->lock);
+  if(!plugged)
+    bdispatch(dev);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -93,10 +555,35 @@ bread(uint dev, uint blockno)
   struct buf *b;
 
   b = bget(dev, blockno);
+  if(b->disk){
+    // breadahead() started reading it; let that finish.
+    bwait(b);
+    __sync_fetch_and_add(&bcache.ralate, 1);
+  }
   if(!b->valid) {
-    virtio_disk_rw(b->dev, b, 0);
+    bsubmit(b, 0);
+    bwait(b);
     b->valid = 1;
   }
+  if(b->ra){
+    b->ra = 0;
+    __sync_fetch_and_add(&bcache.rahits, 1);
+  }
+  return b;
+}
+
+// Return a locked buf for the indicated block without reading it
+// from disk. The caller must overwrite all of b->data.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(b->disk)
+    bwait(b);
+  b->valid = 1;
+  b->ra = 0;
   return b;
 }
 
@@ -106,11 +593,119 @@ bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b->dev, b, 1);
+  bsubmit(b, 1);
+  bwait(b);
+}
+
+// Set up s, a struct buf that is not in the cache, to write
+// b's contents to block blockno rather than to b's own block.
+// b must stay locked until bwait(s) returns.
+// The log uses this to install a committed copy of a block
+// without disturbing the cached copy, which may be newer.
+void
+bshadow(struct buf *b, struct buf *s, uint blockno)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bshadow");
+  s->dev = b->dev;
+  s->blockno = blockno;
+  s->data = b->data;
+  s->valid = 1;
+  s->iodone = 0;
+}
+
+// Start writing the n bufs in bs, all for the same device, and
+// return without waiting. Each must be locked, or set up by
+// bshadow(). They go to the disk together, so runs of
+// consecutive blocks each take one disk request.
+void
+bstartwritev(struct buf **bs, int n)
+{
+  int i;
+
+  if(n < 1)
+    return;
+  bplug(bs[0]->dev);
+  for(i = 0; i < n; i++)
+    bsubmit(bs[i], 1);
+  bunplug(bs[0]->dev);
+}
+
+// Make every write to dev that has completed durable, in case
+// the disk caches writes.
+void
+bflush(uint dev)
+{
+  struct buf b;
+
+  bdispatch(dev);
+  memset(&b, 0, sizeof(b));
+  b.dev = dev;
+  virtio_disk_flush(dev, &b);
+  bwait(&b);
+}
+
+// Tell dev that blocks blockno .. blockno+n-1 hold nothing of
+// use, so that it can reclaim their space, and wait until it has.
+// Returns the number of blocks discarded, 0 if the disk can't.
+uint
+bdiscard(uint dev, uint blockno, uint n)
+{
+  struct buf b;
+  uint k, done = 0;
+
+  for(; n > 0; blockno += k, n -= k){
+    memset(&b, 0, sizeof(b));
+    b.dev = dev;
+    k = virtio_disk_discard(dev, &b, blockno, n);
+    bwait(&b);
+    if(k == 0)
+      break;
+    __sync_fetch_and_add(&bqueue[dev].ndiscard, k);
+    done += k;
+  }
+  return done;
+}
+
+// Wait for the disk to finish with b.
+void
+bwait(struct buf *b)
+{
+  struct bqueue *q = &bqueue[b->dev];
+
+  acquire(&q->lock);
+  if(b->disk == 2){
+    // b is still queued, perhaps behind a plug, or being
+    // dispatched by someone else.
+    release(&q->lock);
+    bdispatch(b->dev);
+    acquire(&q->lock);
+    while(b->disk == 2)
+      sleep(q, &q->lock);
+  }
+  release(&q->lock);
+  virtio_disk_wait(b->dev, b);
+}
+
+// Drop a reference to b.
+// If it is hot, stamp it with the time of release for LRU eviction;
+// probationary buffers keep their stamp from bget() (FIFO).
+static void
+bunref(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0 && !b->probe) {
+    // no one is waiting for it.
+    b->lastuse = __sync_fetch_and_add(&bcache.stamp, 1);
+  }
+  release(&bk->lock);
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
 void
 brelse(struct buf *b)
 {
@@ -118,34 +713,106 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bunref(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+// b->iodone for breadahead(): runs when the disk completes the
+// read and drops the reference the read held.
+static void
+bdone(struct buf *b)
+{
+  bunref(b);
+}
+
+// Start reading block blockno of dev into the cache and return
+// without waiting.  Does nothing if the block is cached already.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(b->valid || b->disk){
+    brelse(b);
+    return;
+  }
+  b->ra = 1;
+  b->iodone = bdone;
+  bsubmit(b, 0);
+  __sync_fetch_and_add(&bcache.raissued, 1);
+  // The read keeps our reference until bdone(), but anyone may
+  // lock the buffer meanwhile; bread() waits for the read.
+  releasesleep(&b->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
+}
+
+// Like ntas(): iostat(0) resets the block I/O statistics,
+// iostat(1) prints them and returns the total number of misses.
+uint64
+sys_iostat(void)
+{
+  int show, i;
+  uint64 tot = 0;
+
+  if(argint(0, &show) < 0)
+    return -1;
+  if(show == 0){
+    for(i = 0; i < NBCLASS; i++){
+      bcache.hits[i] = 0;
+      bcache.misses[i] = 0;
+    }
+    bcache.raissued = bcache.rahits = bcache.ralate = bcache.rawasted = 0;
+    for(i = 0; i < NDISK; i++)
+      bqueue[i].nbuf = bqueue[i].nreq = bqueue[i].ndiscard = 0;
+    dcstat(0);
+    virtio_disk_stat(0);
+    return 0;
+  }
+
+  printf("=== bcache: %d buffers, %d probationary\n", bcache.nbuf, bcache.nprobe);
+  for(i = 0; i < NBCLASS; i++){
+    printf("%s: hits %d misses %d\n", bcname[i], bcache.hits[i], bcache.misses[i]);
+    tot += bcache.misses[i];
+  }
+  printf("read-ahead: issued %d hits %d late %d wasted %d\n",
+         bcache.raissued, bcache.rahits, bcache.ralate, bcache.rawasted);
+  for(i = 0; i < NDISK; i++)
+    if(bqueue[i].nreq)
+      printf("queue %d: bufs %d requests %d discarded %d\n", i,
+             bqueue[i].nbuf, bqueue[i].nreq, bqueue[i].ndiscard);
+  dcstat(1);
+  virtio_disk_stat(1);
+  return tot;
 }
 
+// iopoll(1) makes waiting for the disk poll for completion,
+// iopoll(0) makes it sleep until the interrupt.
+// Returns whether polling was on.
+uint64
+sys_iopoll(void)
+{
+  int on, i, old = 0;
 
+  if(argint(0, &on) < 0)
+    return -1;
+  for(i = 0; i < NDISK; i++)
+    old |= virtio_disk_poll(i, on != 0);
+  return old;
+}
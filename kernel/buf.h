@@ -1,12 +1,28 @@
 struct buf {
   int valid;   // has data been read from disk?
-  int disk;    // does disk "own" buf?
+  int disk;    // does disk "own" buf? 2 if still in the request queue
+  int write;   // is the queued request a write?
+  int ra;      // read ahead, not yet used by bread()?
+  void (*iodone)(struct buf*); // if set, called when disk is done with buf
+  struct buf *dnext; // next buf in the request queue or disk request
+  int vq;      // virtio queue of the request in flight
+  uint64 stime; // r_time() when the request was submitted
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int probe;    // on the probationary queue? (see bio.c)
+  uint lastuse; // replacement stamp, see bio.c
+  struct buf *prev; // hash bucket or free list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data;      // BSIZE bytes of a page shared with other bufs
 };
 
+// Block classes, for buffer cache replacement and statistics.
+#define BC_DATA     0
+#define BC_SUPER    1   // boot block and superblock
+#define BC_LOGHDR   2
+#define BC_LOG      3
+#define BC_INODE    4
+#define BC_BITMAP   5
+#define NBCLASS     6
@@ -0,0 +1,163 @@
+// Directory entry cache.
+//
+// Maps (dev, directory inum, name) to the inum of the entry and
+// its byte offset in the directory, so that namex() and friends
+// don't have to read through a directory for every path element
+// they look up. A negative entry (inum 0) records that the name
+// is not in the directory.
+//
+// The cache is only correct because of how the file system uses
+// it. dirlookup() consults and fills it while holding the
+// directory's inode lock, and everything that changes a
+// directory's entries holds that lock too and keeps the cache up
+// to date: dirlink() enters the new name, dirunlink() makes it
+// negative, and freeing a directory inode purges all of its
+// entries, since its inum may be reused.
+//
+// The cache is set-associative: a (dev, dir, name) hashes to one
+// of NDCBUCKET buckets, each holding NDCWAY entries under its own
+// spin-lock, replaced in LRU order.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "fs.h"
+
+#define NDCBUCKET 31
+#define NDCWAY    8
+
+struct dentry {
+  uint dev;
+  uint dir;       // inum of directory, or 0 if the entry is free
+  uint inum;      // inum named, or 0 if name isn't in dir
+  uint off;       // byte offset of the dirent in dir
+  uint lastuse;
+  char name[DIRSIZ];
+};
+
+struct dbucket {
+  struct spinlock lock;
+  uint stamp;
+  struct dentry e[NDCWAY];
+};
+
+struct {
+  struct dbucket bucket[NDCBUCKET];
+  uint hits;
+  uint misses;
+} dcache;
+
+void
+dcinit(void)
+{
+  struct dbucket *bk;
+
+  for(bk = dcache.bucket; bk < dcache.bucket+NDCBUCKET; bk++)
+    initlock(&bk->lock, "dcache");
+}
+
+static struct dbucket*
+dchash(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.bucket[h % NDCBUCKET];
+}
+
+// Find the entry for (dev, dir, name) in bk. Caller holds bk->lock.
+static struct dentry*
+dcfind(struct dbucket *bk, uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  for(d = bk->e; d < bk->e+NDCWAY; d++)
+    if(d->dir == dir && d->dev == dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Look up name in directory dir on dev.
+// Returns 1 and sets *inum and *off if the cache knows the
+// answer; *inum is 0 if name is not in the directory.
+// Returns 0 if the cache doesn't know.
+int
+dclookup(uint dev, uint dir, char *name, uint *inum, uint *off)
+{
+  struct dbucket *bk = dchash(dev, dir, name);
+  struct dentry *d;
+
+  acquire(&bk->lock);
+  if((d = dcfind(bk, dev, dir, name)) == 0){
+    release(&bk->lock);
+    __sync_fetch_and_add(&dcache.misses, 1);
+    return 0;
+  }
+  d->lastuse = ++bk->stamp;
+  *inum = d->inum;
+  *off = d->off;
+  release(&bk->lock);
+  __sync_fetch_and_add(&dcache.hits, 1);
+  return 1;
+}
+
+// Record that name in directory dir on dev is inum, at byte
+// offset off, or that it is not there if inum is 0.
+// Caller holds the directory's inode lock.
+void
+dcenter(uint dev, uint dir, char *name, uint inum, uint off)
+{
+  struct dbucket *bk = dchash(dev, dir, name);
+  struct dentry *d, *victim;
+
+  acquire(&bk->lock);
+  if((victim = dcfind(bk, dev, dir, name)) == 0){
+    victim = bk->e;
+    for(d = bk->e; d < bk->e+NDCWAY; d++){
+      if(d->dir == 0){
+        victim = d;
+        break;
+      }
+      if(d->lastuse < victim->lastuse)
+        victim = d;
+    }
+    victim->dev = dev;
+    victim->dir = dir;
+    strncpy(victim->name, name, DIRSIZ);
+  }
+  victim->inum = inum;
+  victim->off = off;
+  victim->lastuse = ++bk->stamp;
+  release(&bk->lock);
+}
+
+// Forget every entry of directory dir on dev, which is being freed.
+void
+dcpurge(uint dev, uint dir)
+{
+  struct dbucket *bk;
+  struct dentry *d;
+
+  for(bk = dcache.bucket; bk < dcache.bucket+NDCBUCKET; bk++){
+    acquire(&bk->lock);
+    for(d = bk->e; d < bk->e+NDCWAY; d++)
+      if(d->dir == dir && d->dev == dev)
+        d->dir = 0;
+    release(&bk->lock);
+  }
+}
+
+// Print the cache's hit statistics for iostat, or reset them.
+void
+dcstat(int show)
+{
+  if(show == 0){
+    dcache.hits = dcache.misses = 0;
+    return;
+  }
+  printf("dcache: hits %d misses %d\n", dcache.hits, dcache.misses);
+}
@@ -4,6 +4,7 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct rastate;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -12,10 +13,22 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bnew(uint, uint);
+void            breadahead(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bshadow(struct buf*, struct buf*, uint);
+void            bstartwritev(struct buf**, int);
+void            bflush(uint);
+uint            bdiscard(uint, uint, uint);
+void            bplug(uint);
+void            bunplug(uint);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
+uint64          sys_iostat(void);
+uint64          sys_iopoll(void);
 
 // console.c
 void            consoleinit(void);
@@ -34,11 +47,23 @@ int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 
+// dcache.c
+void            dcinit(void);
+int             dclookup(uint, uint, char*, uint*, uint*);
+void            dcenter(uint, uint, char*, uint, uint);
+void            dcpurge(uint, uint);
+void            dcstat(int);
+
 // fs.c
 void            fsinit(int);
+int             blockclass(uint, uint);
+int             iputblocks(int);
+int             writeextra(int);
 int             dirlink(struct inode*, char*, uint);
+void            dirunlink(struct inode*, char*, uint);
+int             dirempty(struct inode*);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
@@ -46,10 +71,13 @@ void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+void            iflushdirty(int);
+int             btrim(int);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readahead(struct inode*, struct rastate*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 
@@ -67,7 +95,14 @@ void            kinit();
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(int);
+void            begin_op_n(int, int);
 void            end_op(int);
+void            log_force(int);
+int             log_max(int);
+void            log_free(int, uint);
+void            log_unfree(int, uint);
+int             log_freed(int, uint);
+void            logflusher(void);
 void            crash_op(int,int);
 
 // pipe.c
@@ -93,6 +128,7 @@ struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+void            kproc(char*, void (*)(void));
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
@@ -180,8 +216,13 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(int);
-void            virtio_disk_rw(int, struct buf *, int);
+void            virtio_disk_submitv(int, struct buf **, int, int);
+void            virtio_disk_flush(int, struct buf *);
+uint            virtio_disk_discard(int, struct buf *, uint, uint);
+void            virtio_disk_wait(int, struct buf *);
 void            virtio_disk_intr(int);
+int             virtio_disk_poll(int, int);
+void            virtio_disk_stat(int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -3,6 +3,9 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
@@ -21,7 +24,7 @@ exec(char *path, char **argv)
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
-  begin_op(ROOTDEV);
+  begin_op_n(ROOTDEV, iputblocks(ROOTDEV));
 
   if((ip = namei(path)) == 0){
     end_op(ROOTDEV);
@@ -134,6 +137,7 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
 {
   uint i, n;
   uint64 pa;
+  struct rastate ra = { offset, 0, 0 };
 
   if((va % PGSIZE) != 0)
     panic("loadseg: va must be page aligned");
@@ -146,6 +150,7 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
       n = sz - i;
     else
       n = PGSIZE;
+    readahead(ip, &ra, offset+i, n);
     if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
       return -1;
   }
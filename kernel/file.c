@@ -76,7 +76,7 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op(ff.ip->dev);
+    begin_op_n(ff.ip->dev, iputblocks(ff.ip->dev));
     iput(ff.ip);
     end_op(ff.ip->dev);
   }
@@ -119,6 +119,7 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
+    readahead(f->ip, &f->ra, f->off, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
@@ -146,20 +147,21 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(f, 1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write up to half the log at a time, so that other
+    // system calls can run alongside. each piece reserves
+    // its data blocks plus writeextra() more; initlog()
+    // makes sure that leaves room for at least one block.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int extra = writeextra(f->ip->dev);
+    int max = (log_max(f->ip->dev)/2 - extra) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op(f->ip->dev);
+      begin_op_n(f->ip->dev, (n1 + BSIZE - 1) / BSIZE + extra);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -1,3 +1,10 @@
+// Read-ahead state of a sequential reader; see readahead() in fs.c.
+struct rastate {
+  uint next;    // offset at which the next sequential read starts
+  uint block;   // first block not yet read ahead
+  uint win;     // read-ahead window, in blocks
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
   int ref; // reference count
@@ -6,6 +13,7 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE and FD_DEVICE
+  struct rastate ra; // FD_INODE
   short major;       // FD_DEVICE
   short minor;       // FD_DEVICE
 };
@@ -19,15 +27,23 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *prev; // hash bucket or free list
+  struct inode *next;
+  struct inode *lprev; // LRU list, if ref is 0
+  struct inode *lnext;
+  uint seq;           // odd while a directory's entries change
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int dirty;          // changed since copied to its block? (see fs.c)
+  struct inode *dnext; // dirty list
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint xaddr;
 };
 
 // map major device number to device functions.
@@ -23,6 +23,8 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void bfreeinit(int);
+static void ifreeinit(int);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -45,45 +47,213 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bfreeinit(dev);
+  ifreeinit(dev);
 }
 
-// Zero a block.
-static void
-bzero(int dev, int bno)
+// Max # of blocks that freeing an inode writes: its inode
+// block and the free bitmap. For begin_op_n() estimates.
+int
+iputblocks(int dev)
 {
-  struct buf *bp;
+  return 1 + (sb.size + BPB - 1) / BPB;
+}
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
-  log_write(bp);
-  brelse(bp);
+// Max # of blocks besides its data blocks that writing part of
+// a file writes: the i-node, 2 extent blocks, the free bitmap,
+// and 1 block of slop for non-aligned writes.
+int
+writeextra(int dev)
+{
+  return 1 + 2 + (sb.size + BPB - 1) / BPB + 1;
+}
+
+// Classify block blockno for the buffer cache (see bio.c).
+// Before the superblock has been read everything is data.
+int
+blockclass(uint dev, uint blockno)
+{
+  if(blockno < 2)
+    return BC_SUPER;
+  if(sb.magic != FSMAGIC || blockno >= sb.bmapstart + sb.size/BPB + 1)
+    return BC_DATA;
+  if(blockno >= sb.bmapstart)
+    return BC_BITMAP;
+  if(blockno >= sb.inodestart)
+    return BC_INODE;
+  if(blockno == sb.logstart)
+    return BC_LOGHDR;
+  return BC_LOG;
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// The free block and free inode summaries below have an entry
+// for each bitmap or inode block that the superblock says there
+// is, so they live in pages from kalloc(). If there are too many
+// for NSUMPAGE pages, or kalloc() runs out, the file system goes
+// without the summary, and balloc() or ialloc() just looks
+// through every bitmap or inode block in turn.
+#define NSUMPAGE 32
+#define SUMPP    (PGSIZE / sizeof(ushort))  // entries per page
+
+struct summary {
+  uint n;                   // number of entries, or 0 if none
+  ushort *page[NSUMPAGE];
+};
+
+static ushort*
+sument(struct summary *s, uint i)
 {
-  int b, bi, m;
-  struct buf *bp;
+  return &s->page[i / SUMPP][i % SUMPP];
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+// Give s n zeroed entries. Returns 0 if it can't.
+static int
+suminit(struct summary *s, uint n)
+{
+  uint i, np = (n + SUMPP - 1) / SUMPP;
+
+  s->n = 0;
+  if(np > NSUMPAGE)
+    return 0;
+  for(i = 0; i < np; i++){
+    if((s->page[i] = kalloc()) == 0){
+      while(i > 0)
+        kfree(s->page[--i]);
+      return 0;
+    }
+    memset(s->page[i], 0, PGSIZE);
+  }
+  s->n = n;
+  return 1;
+}
+
+// Summary of the free bitmap, so that balloc() doesn't have to
+// scan it from the start. nfree[i] counts the free bits in bitmap
+// block i that no balloc() has claimed yet: balloc() takes one
+// before it looks for the bit, and bfree() gives one back after
+// clearing a bit, so a balloc() that got one always finds a free
+// bit. The summary is rebuilt from the on-disk bitmap at boot,
+// after recovery, so it needs no logging.
+struct {
+  struct spinlock lock;
+  uint nbmap;         // number of bitmap blocks
+  struct summary nfree;
+  uint cursor;        // next fit: block # to look at first
+} bfreemap;
+
+static void
+bfreeinit(int dev)
+{
+  struct buf *bp;
+  uint64 *w;
+  uint i, b, bi;
+  ushort *nf;
+
+  initlock(&bfreemap.lock, "bfreemap");
+  bfreemap.nbmap = (sb.size + BPB - 1) / BPB;
+  bfreemap.cursor = sb.bmapstart + bfreemap.nbmap;
+  if(!suminit(&bfreemap.nfree, bfreemap.nbmap)){
+    printf("fs: no free block summary\n");
+    return;
+  }
+  for(i = 0; i < bfreemap.nbmap; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    w = (uint64*)bp->data;
+    b = i * BPB;
+    nf = sument(&bfreemap.nfree, i);
+    for(bi = 0; bi < BPB && b + bi < sb.size; ){
+      if(bi % 64 == 0 && b + bi + 64 <= sb.size && (w[bi/64] == 0 || ~w[bi/64] == 0)){
+        if(w[bi/64] == 0)
+          *nf += 64;
+        bi += 64;
+        continue;
       }
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        (*nf)++;
+      bi++;
+    }
+    brelse(bp);
+  }
+}
+
+// Find a clear bit among the first nbits bits of the bitmap
+// block map, starting at bit start and wrapping around.
+// Skips whole words and bytes that are all ones.
+static int
+bmapscan(uchar *map, uint start, uint nbits)
+{
+  uint64 *w = (uint64*)map;
+  uint bi, k;
+
+  for(k = 0; k < nbits; ){
+    bi = (start + k) % nbits;
+    if(bi % 64 == 0 && bi + 64 <= nbits && ~w[bi/64] == 0){
+      k += 64;
+    } else if(bi % 8 == 0 && bi + 8 <= nbits && map[bi/8] == 0xff){
+      k += 8;
+    } else if((map[bi/8] & (1 << (bi % 8))) == 0){
+      return bi;
+    } else {
+      k++;
     }
+  }
+  return -1;
+}
+
+// Allocate a disk block, preferably goal or one soon after it.
+// The block isn't zeroed, since callers overwrite it anyway;
+// see bmapbuf(). With no goal (0), starts at the cursor instead.
+// Looks first in the bitmap block with the starting point,
+// from there on, and then in the next bitmap block with free
+// bits according to the summary, or, without a summary, in each
+// following bitmap block until one has a free bit.
+static uint
+balloc(uint dev, uint goal)
+{
+  int bi;
+  uint i, k, from, start;
+  struct buf *bp;
+
+  acquire(&bfreemap.lock);
+  from = goal > 0 && goal < sb.size ? goal : bfreemap.cursor;
+  start = from / BPB;
+  for(k = 0; k < bfreemap.nbmap; k++){
+    i = (start + k) % bfreemap.nbmap;
+    if(bfreemap.nfree.n == 0 || *sument(&bfreemap.nfree, i) > 0)
+      break;
+  }
+  if(k == bfreemap.nbmap)
+    panic("balloc: out of blocks");
+  if(bfreemap.nfree.n)
+    (*sument(&bfreemap.nfree, i))--;
+  bi = k == 0 ? from % BPB : 0;
+  release(&bfreemap.lock);
+
+  for(;;){
+    bp = bread(dev, sb.bmapstart + i);
+    bi = bmapscan(bp->data, bi, min(BPB, sb.size - i*BPB));
+    if(bi >= 0)
+      break;
     brelse(bp);
+    if(bfreemap.nfree.n)
+      panic("balloc: bad summary");
+    if(++k == bfreemap.nbmap)
+      panic("balloc: out of blocks");
+    i = (start + k) % bfreemap.nbmap;
+    bi = 0;
   }
-  panic("balloc: out of blocks");
+  bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+  log_write(bp);
+  log_unfree(dev, i*BPB + bi);
+  brelse(bp);
+
+  acquire(&bfreemap.lock);
+  bfreemap.cursor = (i*BPB + bi + 1) % sb.size;
+  release(&bfreemap.lock);
+
+  return i*BPB + bi;
 }
 
 // Free a disk block.
@@ -100,7 +270,46 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  log_free(dev, b);  // discard it once this transaction commits
   brelse(bp);
+
+  acquire(&bfreemap.lock);
+  if(bfreemap.nfree.n)
+    (*sument(&bfreemap.nfree, b / BPB))++;
+  release(&bfreemap.lock);
+}
+
+// Discard every free block of dev, for fstrim(), except those
+// whose frees haven't committed yet, which commit() will discard.
+// Holding each bitmap block's lock keeps balloc() from taking a
+// block while it is being discarded.
+// Returns the number of blocks discarded, or -1 if the disk
+// can't discard.
+int
+btrim(int dev)
+{
+  struct buf *bp;
+  uint i, b, bi, start, k, n = 0;
+
+  for(i = 0; i < bfreemap.nbmap; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    for(bi = 0; bi < BPB && i*BPB + bi < sb.size; bi++){
+      b = i*BPB + bi;
+      if((bp->data[bi/8] & (1 << (bi % 8))) || log_freed(dev, b))
+        continue;
+      for(start = b; bi+1 < BPB && b+1 < sb.size; bi++, b++){
+        if((bp->data[(bi+1)/8] & (1 << ((bi+1) % 8))) || log_freed(dev, b+1))
+          break;
+      }
+      if((k = bdiscard(dev, start, b - start + 1)) == 0){
+        brelse(bp);
+        return -1;
+      }
+      n += k;
+    }
+    brelse(bp);
+  }
+  return n;
 }
 
 // Inodes.
@@ -163,64 +372,269 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The cache is a hash table of inodes keyed by (dev, inum), with
+// a spin-lock per bucket. An entry whose ref has fallen to zero
+// stays in its bucket, still valid, and goes on an LRU list, so
+// that using the inode again finds it without reading it from
+// disk. When iget() misses, it takes an entry that was never used,
+// or grows the cache a page of entries at a time with kalloc(), up
+// to NINODEMAX entries, or else reuses the least recently released
+// entry on the LRU list. The cache never shrinks.
+//
+// A bucket's lock protects the ip->ref, ip->dev, and ip->inum
+// fields of the inodes in it, as well as the bucket list; one
+// must hold it while using any of those fields. icache.lrulock
+// protects the LRU list, and is taken after a bucket lock.
+// icache.lock serializes misses, and protects the free list and
+// the growth of the cache; it is taken before a bucket lock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+//
+// iupdate() is write-back within a transaction: the first
+// iupdate() of an inode in a transaction copies it into its
+// inode block and logs the block, and marks the inode dirty;
+// later ones do nothing. Before the committer closes the
+// transaction, iflushdirty() copies every dirty inode into its
+// block again. idirty.lock protects the dirty list and the
+// ip->dirty flags.
+
+#define NIBUCKET 13
+#define IPP      (PGSIZE/sizeof(struct inode))   // inodes per page
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode head;
+};
 
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct inode free;    // entries that never held an inode
+  int ninode;           // entries, in inode[] and grown
+  struct ibucket bucket[NIBUCKET];
+  struct spinlock lrulock;
+  struct inode lru;     // unreferenced entries, least recent first
 } icache;
 
+struct {
+  struct spinlock lock;
+  struct inode *head;   // dirty inodes, linked by ip->dnext
+} idirty;
+
+static struct ibucket*
+ihash(uint dev, uint inum)
+{
+  return &icache.bucket[(dev * 31 + inum) % NIBUCKET];
+}
+
+// Insert ip after pos in a list, or unlink it.
+// Caller holds the list's lock.
+static void
+ilink(struct inode *pos, struct inode *ip)
+{
+  ip->next = pos->next;
+  ip->prev = pos;
+  pos->next->prev = ip;
+  pos->next = ip;
+}
+
+static void
+iunlink(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+// The LRU list links through lnext/lprev instead.
+static void
+lrulink(struct inode *ip)
+{
+  acquire(&icache.lrulock);
+  ip->lnext = &icache.lru;
+  ip->lprev = icache.lru.lprev;
+  icache.lru.lprev->lnext = ip;
+  icache.lru.lprev = ip;
+  release(&icache.lrulock);
+}
+
+static void
+lruunlink(struct inode *ip)
+{
+  acquire(&icache.lrulock);
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext = ip->lprev = 0;
+  release(&icache.lrulock);
+}
+
+// Put n new entries starting at ip on the free list.
+// Caller holds icache.lock.
+static void
+ifree(struct inode *ip, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    initsleeplock(&ip[i].lock, "inode");
+    ilink(&icache.free, &ip[i]);
+  }
+  icache.ninode += n;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
+  struct ibucket *bk;
+
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+  initlock(&icache.lrulock, "icache.lru");
+  initlock(&idirty.lock, "idirty");
+  for(bk = icache.bucket; bk < icache.bucket+NIBUCKET; bk++){
+    initlock(&bk->lock, "icache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  icache.free.prev = &icache.free;
+  icache.free.next = &icache.free;
+  icache.lru.lprev = &icache.lru;
+  icache.lru.lnext = &icache.lru;
+  acquire(&icache.lock);
+  ifree(icache.inode, NINODE);
+  release(&icache.lock);
+}
+
+// Find an entry for iget() to fill in, and unlink it from
+// wherever it was. Caller holds icache.lock.
+static struct inode*
+ivictim(void)
+{
+  struct inode *ip;
+  struct ibucket *bk;
+  char *pa;
+
+  if(icache.free.next == &icache.free && icache.ninode + IPP <= NINODEMAX &&
+     (pa = kalloc()) != 0){
+    memset(pa, 0, PGSIZE);
+    ifree((struct inode*)pa, IPP);
+  }
+  if(icache.free.next != &icache.free){
+    ip = icache.free.next;
+    iunlink(ip);
+    return ip;
+  }
+
+  // Reuse the least recently released entry. It may get
+  // referenced again before we hold its bucket lock.
+  while(1){
+    acquire(&icache.lrulock);
+    ip = icache.lru.lnext;
+    release(&icache.lrulock);
+    if(ip == &icache.lru)
+      panic("iget: no inodes");
+    bk = ihash(ip->dev, ip->inum);
+    acquire(&bk->lock);
+    if(ip->ref == 0 && ip->lnext != 0){
+      lruunlink(ip);
+      iunlink(ip);
+      release(&bk->lock);
+      return ip;
+    }
+    release(&bk->lock);
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Summary of free inodes, like bfreemap for blocks: nfree[i]
+// counts the free inodes in inode block i that no ialloc() has
+// claimed yet. ialloc() takes one before it reads the block,
+// and iput() gives one back after freeing an inode. Rebuilt
+// from the inode blocks at boot.
+struct {
+  struct spinlock lock;
+  uint niblock;       // number of inode blocks
+  struct summary nfree;
+  uint cursor;        // next fit: inode block to look at first
+} ifreemap;
+
+static void
+ifreeinit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint i, inum;
+
+  initlock(&ifreemap.lock, "ifreemap");
+  ifreemap.niblock = (sb.ninodes + IPB - 1) / IPB;
+  ifreemap.cursor = 0;
+  if(!suminit(&ifreemap.nfree, ifreemap.niblock)){
+    printf("fs: no free inode summary\n");
+    return;
+  }
+  for(i = 0; i < ifreemap.niblock; i++){
+    bp = bread(dev, sb.inodestart + i);
+    for(inum = i*IPB; inum < (i+1)*IPB && inum < sb.ninodes; inum++){
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(inum > 0 && dip->type == 0)
+        (*sument(&ifreemap.nfree, i))++;
+    }
+    brelse(bp);
+  }
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
+// Prefers the inode block that holds inode near, usually the
+// parent directory, so that a directory's inodes are read
+// together; with no near (0), starts at the cursor.
+// Without a summary, looks in each inode block in turn.
 // Returns an unlocked but allocated and referenced inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
-  int inum;
+  uint i, k, inum, start;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  acquire(&ifreemap.lock);
+  start = near > 0 && near < sb.ninodes ? near / IPB : ifreemap.cursor;
+  for(k = 0; k < ifreemap.niblock; k++){
+    i = (start + k) % ifreemap.niblock;
+    if(ifreemap.nfree.n == 0 || *sument(&ifreemap.nfree, i) > 0)
+      break;
+  }
+  if(k == ifreemap.niblock)
+    panic("ialloc: no inodes");
+  if(ifreemap.nfree.n)
+    (*sument(&ifreemap.nfree, i))--;
+  ifreemap.cursor = i;
+  release(&ifreemap.lock);
+
+  for(; k < ifreemap.niblock; k++){
+    i = (start + k) % ifreemap.niblock;
+    bp = bread(dev, sb.inodestart + i);
+    for(inum = i*IPB; inum < (i+1)*IPB && inum < sb.ninodes; inum++){
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(inum > 0 && dip->type == 0){  // a free inode
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        log_write(bp);   // mark it allocated on the disk
+        brelse(bp);
+        return iget(dev, inum);
+      }
     }
     brelse(bp);
+    if(ifreemap.nfree.n)
+      panic("ialloc: bad summary");
   }
   panic("ialloc: no inodes");
 }
 
-// Copy a modified in-memory inode to disk.
-// Must be called after every change to an ip->xxx field
-// that lives on disk, since i-node cache is write-through.
-// Caller must hold ip->lock.
-void
-iupdate(struct inode *ip)
+// Copy ip to its inode block, and log the block if logit.
+static void
+iwrite(struct inode *ip, int logit)
 {
   struct buf *bp;
   struct dinode *dip;
@@ -232,42 +646,121 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-  log_write(bp);
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->xaddr = ip->xaddr;
+  if(logit)
+    log_write(bp);
   brelse(bp);
 }
 
+// Take ip off the dirty list. Its inode block is in the open
+// transaction, so copying ip there needs no log_write().
+static void
+iclean(struct inode *ip)
+{
+  struct inode **pp;
+
+  acquire(&idirty.lock);
+  for(pp = &idirty.head; *pp; pp = &(*pp)->dnext){
+    if(*pp == ip){
+      *pp = ip->dnext;
+      break;
+    }
+  }
+  ip->dirty = 0;
+  release(&idirty.lock);
+  iwrite(ip, 0);
+}
+
+// Copy a modified in-memory inode to disk.
+// Must be called after every change to an ip->xxx field
+// that lives on disk, and inside a transaction.
+// Caller must hold ip->lock.
+void
+iupdate(struct inode *ip)
+{
+  if(ip->dirty)
+    return;  // iflushdirty() will copy it at commit
+  iwrite(ip, 1);
+  acquire(&idirty.lock);
+  ip->dirty = 1;
+  ip->dnext = idirty.head;
+  idirty.head = ip;
+  release(&idirty.lock);
+}
+
+// Copy every dirty inode on dev to its inode block. Called by
+// the committer before it closes the transaction, while no
+// system call is running, so no one is changing the inodes.
+void
+iflushdirty(int dev)
+{
+  struct inode **pp, *ip;
+
+  acquire(&idirty.lock);
+  for(pp = &idirty.head; (ip = *pp) != 0; ){
+    if(ip->dev != dev){
+      pp = &ip->dnext;
+      continue;
+    }
+    *pp = ip->dnext;
+    ip->dirty = 0;
+    release(&idirty.lock);
+    iwrite(ip, 0);
+    acquire(&idirty.lock);
+  }
+  release(&idirty.lock);
+}
+
+// Look for inode inum on device dev in bucket bk, and
+// take a reference to it. Caller holds bk->lock.
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head.next; ip != &bk->head; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruunlink(ip);
+      return ip;
+    }
+  }
+  return 0;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
+  struct ibucket *bk = ihash(dev, inum);
+  struct inode *ip;
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&bk->lock);
+  ip = ifind(bk, dev, inum);
+  release(&bk->lock);
+  if(ip)
+    return ip;
+
+  // Not cached. Only one miss at a time, so that two
+  // can't both add the same inode.
+  acquire(&icache.lock);
+  acquire(&bk->lock);
+  ip = ifind(bk, dev, inum);
+  release(&bk->lock);
+  if(ip == 0){
+    ip = ivictim();
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    acquire(&bk->lock);
+    ilink(&bk->head, ip);
+    release(&bk->lock);
   }
-
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
   release(&icache.lock);
 
   return ip;
@@ -278,9 +771,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -305,9 +800,11 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->xaddr = dip->xaddr;
     brelse(bp);
-    ip->valid = 1;
+    // namex() reads type without the lock once valid is set.
+    __atomic_store_n(&ip->valid, 1, __ATOMIC_RELEASE);
     if(ip->type == 0)
       panic("ilock: no type");
   }
@@ -324,8 +821,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry goes
+// on the LRU list, to be recycled when the cache needs it.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -333,7 +830,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -342,20 +841,40 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&bk->lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    iclean(ip);  // ialloc() looks at the inode block
     ip->valid = 0;
 
+    acquire(&ifreemap.lock);
+    if(ifreemap.nfree.n)
+      (*sument(&ifreemap.nfree, ip->inum / IPB))++;
+    release(&ifreemap.lock);
+
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&bk->lock);
+  }
+
+  if(ip->ref == 1 && ip->dirty){
+    // the cache may recycle ip once it has no references,
+    // so write it back now.
+    acquiresleep(&ip->lock);
+    release(&bk->lock);
+    iclean(ip);
+    releasesleep(&ip->lock);
+    acquire(&bk->lock);
   }
 
   ip->ref--;
-  release(&icache.lock);
+  if(ip->ref == 0)
+    lrulink(ip);
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -369,40 +888,122 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk, in runs of consecutive blocks called
+// extents. The first NEXTENT extents are listed in ip->ext[].
+// The rest are listed in a chain of extent blocks starting
+// at ip->xaddr. Files only grow at the end, so there are
+// no holes.
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one; bn can be
+// at most one past the end of the file. bmap tries to put the
+// new block right after the file's last block, so that it grows
+// the last extent, and only starts a new extent if that fails.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr, off, x;
+  int i, ni;
+  struct extent *last;
+  struct xblock *xb;
+  struct buf *bp, *nbp;
+
+  off = 0;
+  last = 0;
+  for(i = 0; i < NEXTENT && ip->ext[i].len > 0; i++){
+    last = &ip->ext[i];
+    if(bn < off + last->len)
+      return last->start + bn - off;
+    off += last->len;
+  }
+  ni = i;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
-  }
-  bn -= NDIRECT;
-
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  // Search the extent blocks, keeping the last one locked.
+  bp = 0;
+  xb = 0;
+  for(x = ip->xaddr; x; x = xb->next){
+    if(bp)
+      brelse(bp);
+    bp = bread(ip->dev, x);
+    xb = (struct xblock*)bp->data;
+    for(i = 0; i < xb->n; i++){
+      last = &xb->e[i];
+      if(bn < off + last->len){
+        addr = last->start + bn - off;
+        brelse(bp);
+        return addr;
+      }
+      off += last->len;
     }
+  }
+
+  if(bn != off)
+    panic("bmap: out of range");
+
+  addr = balloc(ip->dev, last ? last->start + last->len : 0);
+  if(last && addr == last->start + last->len){
+    last->len++;
+  } else if(bp == 0 && ni < NEXTENT){
+    ip->ext[ni].start = addr;
+    ip->ext[ni].len = 1;
+  } else if(bp && xb->n < NXEXTENT){
+    xb->e[xb->n].start = addr;
+    xb->e[xb->n].len = 1;
+    xb->n++;
+  } else {
+    // Start a new extent block.
+    x = balloc(ip->dev, 0);
+    nbp = bnew(ip->dev, x);
+    memset(nbp->data, 0, BSIZE);
+    xb = (struct xblock*)nbp->data;
+    xb->n = 1;
+    xb->e[0].start = addr;
+    xb->e[0].len = 1;
+    log_write(nbp);
+    brelse(nbp);
+    if(bp)
+      ((struct xblock*)bp->data)->next = x;
+    else
+      ip->xaddr = x;
+  }
+  if(bp){
+    log_write(bp);
     brelse(bp);
-    return addr;
   }
+  return addr;
+}
+
+// Return a locked buf holding block bn of ip, allocating the
+// block if bn is one past the end. A block that holds none of
+// the file's data (at or past size) isn't read from disk:
+// the buf is zeroed in memory instead, or left alone if the
+// caller will overwrite all of it (whole). So a new block goes
+// to the log once, with its real contents.
+static struct buf*
+bmapbuf(struct inode *ip, uint bn, int whole)
+{
+  uint addr;
+  struct buf *bp;
+
+  addr = bmap(ip, bn);
+  if(bn < (ip->size + BSIZE - 1) / BSIZE)
+    return bread(ip->dev, addr);
+  bp = bnew(ip->dev, addr);
+  if(!whole)
+    memset(bp->data, 0, BSIZE);
+  return bp;
+}
+
+// Free the blocks of extent e.
+static void
+bfreeext(int dev, struct extent *e)
+{
+  uint b;
 
-  panic("bmap: out of range");
+  for(b = e->start; b < e->start + e->len; b++)
+    bfree(dev, b);
+  e->start = 0;
+  e->len = 0;
 }
 
 // Truncate inode (discard contents).
@@ -413,28 +1014,24 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
+  int i;
+  uint x, next;
   struct buf *bp;
-  uint *a;
+  struct xblock *xb;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
-  }
+  for(i = 0; i < NEXTENT; i++)
+    bfreeext(ip->dev, &ip->ext[i]);
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
+  for(x = ip->xaddr; x; x = next){
+    bp = bread(ip->dev, x);
+    xb = (struct xblock*)bp->data;
+    for(i = 0; i < xb->n; i++)
+      bfreeext(ip->dev, &xb->e[i]);
+    next = xb->next;
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, x);
   }
+  ip->xaddr = 0;
 
   ip->size = 0;
   iupdate(ip);
@@ -479,6 +1076,47 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return n;
 }
 
+// Read-ahead.
+//
+// A reader that keeps reading where its last read stopped is
+// assumed to be streaming through the file.  Before each of its
+// reads, readahead() starts asynchronous reads of the blocks that
+// follow, so the disk works while the caller copies data out.
+// The window starts at RAMIN blocks and doubles with every
+// sequential read up to RAMAX; a seek closes it again.
+
+#define RAMIN 4
+#define RAMAX 32
+
+// Called with ip locked before reading n bytes at off.
+void
+readahead(struct inode *ip, struct rastate *ra, uint off, uint n)
+{
+  uint bn, end;
+
+  if(off != ra->next){
+    ra->next = off + n;
+    ra->block = 0;
+    ra->win = 0;
+    return;
+  }
+  ra->next = off + n;
+  ra->win = ra->win ? min(2*ra->win, RAMAX) : RAMIN;
+
+  // Blocks below the size are all allocated,
+  // so bmap() won't allocate any.
+  end = min((off + n)/BSIZE + 1 + ra->win, (ip->size + BSIZE - 1)/BSIZE);
+  bn = off/BSIZE + 1;
+  if(bn < ra->block)
+    bn = ra->block;
+  bplug(ip->dev);
+  for(; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+  bunplug(ip->dev);
+  if(end > ra->block)
+    ra->block = end;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -495,8 +1133,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    bp = bmapbuf(ip, off/BSIZE, m == BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
@@ -510,7 +1148,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       ip->size = off;
     // write the i-node back to disk even if the size didn't change
     // because the loop above might have called bmap() and added a new
-    // block to ip->addrs[].
+    // block to ip->ext[].
     iupdate(ip);
   }
 
@@ -525,40 +1163,206 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hash a name for the directory index (FNV-1a).
+// mkfs/mkfs.c has a copy, which must match.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Return a pointer to slot t of the directory's table.
+static ushort*
+dirtab(struct dirhead *h, uint t)
+{
+  return &((struct dirtab*)(h+1))[t/DTPS].b[t%DTPS];
+}
+
+// Read block 0 of directory dp, which holds the dirhead.
+static struct buf*
+dirhead(struct inode *dp)
+{
+  struct buf *bp;
+
+  bp = bread(dp->dev, bmap(dp, 0));
+  if(((struct dirhead*)bp->data)->magic != DIRMAGIC)
+    panic("dirhead: magic");
+  return bp;
+}
+
+// Give the empty directory dp a dirhead and one bucket.
+static void
+dirinit(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirhead *h;
+
+  bp = bmapbuf(dp, 0, 0);
+  h = (struct dirhead*)bp->data;
+  h->magic = DIRMAGIC;
+  *dirtab(h, 0) = 1;
+  log_write(bp);
+  brelse(bp);
+
+  bp = bmapbuf(dp, 1, 0);
+  log_write(bp);
+  brelse(bp);
+
+  dp->size = 2*BSIZE;
+  iupdate(dp);
+}
+
+// Bracket a change to directory dp's entries, so that
+// dirlookupfast() can tell that it raced with one.
+// Caller holds dp->lock.
+static void
+dirchanging(struct inode *dp)
+{
+  __atomic_store_n(&dp->seq, dp->seq + 1, __ATOMIC_RELAXED);
+  __sync_synchronize();
+}
+
+static void
+dirchanged(struct inode *dp)
+{
+  __atomic_store_n(&dp->seq, dp->seq + 1, __ATOMIC_RELEASE);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Only the one bucket that name hashes to is read.
+// Caller must hold dp->lock, which keeps the
+// directory entry cache consistent (see dcache.c).
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, fb, i;
+  struct buf *bp;
+  struct dirhead *h;
+  struct dirent *de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+  if(dclookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  inum = 0;
+  if(dp->size > 0){
+    bp = dirhead(dp);
+    h = (struct dirhead*)bp->data;
+    fb = *dirtab(h, dirhash(name) & ((1 << h->depth) - 1));
+    brelse(bp);
+
+    bp = bread(dp->dev, bmap(dp, fb));
+    de = (struct dirent*)bp->data;
+    for(i = 1; i < DPB; i++){
+      if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+        // entry matches path element
+        inum = de[i].inum;
+        off = fb*BSIZE + i*sizeof(*de);
+        break;
+      }
     }
+    brelse(bp);
+  }
+
+  if(inum == 0){
+    dcenter(dp->dev, dp->inum, name, 0, 0);
+    return 0;
+  }
+  if(poff)
+    *poff = off;
+  dcenter(dp->dev, dp->inum, name, inum, off);
+  return iget(dp->dev, inum);
+}
+
+// Split the full bucket in file block fb of directory dp, whose
+// dirhead is h, moving the entries with the next bit of their
+// hash set to a new bucket at the end of the directory, to make
+// room for a name that hashes to hash.
+// Returns -1, having changed nothing, if the table can't grow any
+// more or if the split would leave no room for the name: a second
+// split would have to go in the same transaction, and the log
+// only has room for one.
+static int
+dirsplit(struct inode *dp, struct dirhead *h, uint fb, uint hash)
+{
+  struct buf *bp, *nbp;
+  struct dirbucket *bk;
+  struct dirent *de, *nde;
+  uint t, ld, nfb, i, j;
+
+  bp = bread(dp->dev, bmap(dp, fb));
+  bk = (struct dirbucket*)bp->data;
+  ld = bk->depth;
+  de = (struct dirent*)bp->data;
+  for(i = 1; i < DPB; i++)
+    if(((dirhash(de[i].name) ^ hash) & (1 << ld)) != 0)
+      break;
+  if(i == DPB || (ld == h->depth && h->depth == DIRMAXDEPTH)){
+    brelse(bp);
+    return -1;
+  }
+  if(ld == h->depth){
+    // Double the table; both halves point at the same buckets.
+    for(t = 0; t < (1 << h->depth); t++)
+      *dirtab(h, t + (1 << h->depth)) = *dirtab(h, t);
+    h->depth++;
   }
 
+  nfb = dp->size / BSIZE;
+  nbp = bmapbuf(dp, nfb, 0);
+  dp->size += BSIZE;
+  iupdate(dp);
+  bk->depth = ld + 1;
+  ((struct dirbucket*)nbp->data)->depth = ld + 1;
+
+  nde = (struct dirent*)nbp->data;
+  for(i = 1, j = 1; i < DPB; i++){
+    if(de[i].inum == 0 || (dirhash(de[i].name) & (1 << ld)) == 0)
+      continue;
+    nde[j] = de[i];
+    memset(&de[i], 0, sizeof(de[i]));
+    // The entry moved, so its cached offset is stale.
+    dcenter(dp->dev, dp->inum, nde[j].name, nde[j].inum,
+            nfb*BSIZE + j*sizeof(*nde));
+    j++;
+  }
+  for(t = 0; t < (1 << h->depth); t++)
+    if(*dirtab(h, t) == fb && (t & (1 << ld)))
+      *dirtab(h, t) = nfb;
+
+  log_write(nbp);
+  brelse(nbp);
+  log_write(bp);
+  brelse(bp);
   return 0;
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// Returns -1 if name is already present, or if the directory
+// is full: name's bucket is full and one split won't make room.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
-  struct dirent de;
+  uint fb, hash, i;
+  int split;
+  struct buf *hbp, *bp;
+  struct dirhead *h;
+  struct dirent *de;
   struct inode *ip;
 
   // Check that name is not present.
@@ -567,22 +1371,83 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
+  dirchanging(dp);
+  if(dp->size == 0)
+    dirinit(dp);
+
+  hash = dirhash(name);
+  hbp = dirhead(dp);
+  h = (struct dirhead*)hbp->data;
+  for(split = 0; ; split = 1){
+    // Look for an empty dirent in name's bucket.
+    fb = *dirtab(h, hash & ((1 << h->depth) - 1));
+    bp = bread(dp->dev, bmap(dp, fb));
+    de = (struct dirent*)bp->data;
+    for(i = 1; i < DPB; i++)
+      if(de[i].inum == 0)
+        break;
+    if(i < DPB)
       break;
+    brelse(bp);
+    if(split)
+      panic("dirlink: split");
+    if(dirsplit(dp, h, fb, hash) < 0){
+      brelse(hbp);
+      dirchanged(dp);
+      return -1;
+    }
   }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
+  strncpy(de[i].name, name, DIRSIZ);
+  de[i].inum = inum;
+  log_write(bp);
+  brelse(bp);
+  h->nent++;
+  log_write(hbp);
+  brelse(hbp);
+  dcenter(dp->dev, dp->inum, name, inum, fb*BSIZE + i*sizeof(*de));
+  dirchanged(dp);
 
   return 0;
 }
 
+// Remove the entry for name, which dirlookup() found at
+// byte offset off, from directory dp. Buckets are never
+// merged, so a directory doesn't shrink.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct buf *bp;
+
+  dirchanging(dp);
+  bp = bread(dp->dev, bmap(dp, off / BSIZE));
+  memset(bp->data + off % BSIZE, 0, sizeof(struct dirent));
+  log_write(bp);
+  brelse(bp);
+
+  bp = dirhead(dp);
+  ((struct dirhead*)bp->data)->nent--;
+  log_write(bp);
+  brelse(bp);
+  dcenter(dp->dev, dp->inum, name, 0, 0);
+  dirchanged(dp);
+}
+
+// Is the directory dp empty except for "." and ".." ?
+int
+dirempty(struct inode *dp)
+{
+  struct buf *bp;
+  uint n;
+
+  if(dp->size == 0)
+    return 1;
+  bp = dirhead(dp);
+  n = ((struct dirhead*)bp->data)->nent;
+  brelse(bp);
+  return n <= 2;
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -622,6 +1487,38 @@ skipelem(char *path, char *name)
   return path;
 }
 
+// Look up name in directory dp using only the directory entry
+// cache, without locking dp. dp->seq tells whether a change to
+// dp's entries overlapped the lookup, in which case the inode
+// found might already have been unlinked and reused. Returns 1
+// and sets *ipp (0 if name is not in dp) if the lookup worked,
+// or 0 if the caller must lock dp and use dirlookup().
+// The caller holds a reference to dp.
+static int
+dirlookupfast(struct inode *dp, char *name, struct inode **ipp)
+{
+  uint seq, inum, off;
+  struct inode *ip;
+
+  seq = __atomic_load_n(&dp->seq, __ATOMIC_ACQUIRE);
+  if(seq & 1)
+    return 0;
+  // A referenced inode stays valid, and valid is set after type.
+  if(__atomic_load_n(&dp->valid, __ATOMIC_ACQUIRE) == 0 || dp->type != T_DIR)
+    return 0;
+  if(!dclookup(dp->dev, dp->inum, name, &inum, &off))
+    return 0;
+  ip = inum ? iget(dp->dev, inum) : 0;
+  __sync_synchronize();
+  if(__atomic_load_n(&dp->seq, __ATOMIC_RELAXED) != seq){
+    if(ip)
+      iput(ip);
+    return 0;
+  }
+  *ipp = ip;
+  return 1;
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
@@ -637,6 +1534,17 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // Try to go on to the next directory without locking this
+    // one, so that lookups through a shared directory like /
+    // don't serialize on its sleep-lock.
+    if((!nameiparent || *path != '\0') && dirlookupfast(ip, name, &next)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
+
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -24,9 +24,31 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// A file's content is a list of extents, each a run of
+// consecutive disk blocks holding consecutive file blocks.
+// The first NEXTENT are in the inode; the rest are in a chain
+// of extent blocks starting at xaddr. Unused extents have len 0.
+struct extent {
+  uint start;           // first disk block
+  uint len;             // number of blocks
+};
+
+#define NEXTENT 6
+#define NXEXTENT ((BSIZE - 2*sizeof(uint)) / sizeof(struct extent))
+
+// Extent block structure
+struct xblock {
+  uint next;            // next extent block, or 0
+  uint n;               // extents in use
+  struct extent e[NXEXTENT];
+};
+
+// max file size in blocks; enough that a file made of
+// one-block extents fits in its inode and three extent blocks,
+// which is more than the 12 direct and 256 indirect blocks
+// that inodes used to have room for. bmap() follows a chain
+// of any length, and a write only adds to its tail.
+#define MAXFILE (NEXTENT + 3*NXEXTENT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +57,8 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];  // Data block extents
+  uint xaddr;           // First extent block
 };
 
 // Inodes per block.
@@ -58,3 +81,36 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Directories are hashed, using extendible hashing. Block 0 of a
+// directory holds a dirhead and a table with 1<<depth slots, each
+// the file block # of a bucket. Each other block is a bucket: a
+// dirbucket followed by DPB-1 dirent slots. Entry name goes in the
+// bucket in table slot dirhash(name) & ((1<<depth)-1). A full bucket
+// splits in two by one more bit of the hash, doubling the table if
+// needed. The dirhead, table, and dirbucket slots start with a zero
+// ushort, so that programs that read a directory as an array of
+// dirents, such as ls, see them as unused.
+#define DIRMAGIC 0x48534944  // "DISH"
+#define DPB (BSIZE / sizeof(struct dirent))  // dirent slots per block
+#define DTPS 7               // table slots per dirtab
+#define DIRMAXDEPTH 8        // table has at most 1<<DIRMAXDEPTH slots
+
+struct dirhead {    // slot 0 of block 0
+  ushort zero;
+  ushort depth;     // global depth
+  uint magic;       // DIRMAGIC
+  uint nent;        // entries, including . and ..
+  uint unused;
+};
+
+struct dirtab {     // slots 1 and up of block 0
+  ushort zero;
+  ushort b[DTPS];   // file block # of bucket
+};
+
+struct dirbucket {  // slot 0 of each bucket
+  ushort zero;
+  ushort depth;     // local depth
+  char unused[12];
+};
+
@@ -65,16 +65,22 @@ kfree(void *pa)
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When out of pages, asks the buffer cache to give some back.
+// Must not be called holding a buffer cache lock.
 void *
 kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(int reclaim = 0;; reclaim = 1){
+    acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r)
+      kmem.freelist = r->next;
+    release(&kmem.lock);
+    if(r || reclaim || bshrink(1) == 0)
+      break;
+  }
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
@@ -6,12 +6,13 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only closes a transaction when there
+// are no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -19,22 +20,121 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until a commit makes room. begin_op_n() reserves
+// room for as many blocks as the system call says it will
+// write; begin_op() reserves MAXOPBLOCKS. Each block the
+// system call adds to the transaction uses up one, and
+// end_op() gives back the rest.
+//
+// Commits are lazy. The last outstanding end_op() only closes
+// the transaction if it is due: it holds half as many blocks as
+// a transaction may, it has been open for COMMITTICKS, or
+// someone is waiting for it (log_force(), which implements
+// fsync(), or a begin_op() that needs the space). Otherwise
+// later system calls join it, and the log flusher process
+// commits it once it has been open for COMMITTICKS. So a crash
+// can lose up to COMMITTICKS of system calls, but never leaves
+// the file system inconsistent.
+//
+// Commits are pipelined. When end_op() closes a transaction, it
+// briefly holds off begin_op() while it copies the transaction's
+// blocks from the cache into the log's buffers, then lets new
+// system calls start a new transaction while it writes the copy
+// to the log. If another transaction has closed by the time it
+// is done, it commits that one too, so a busy system commits
+// groups of system calls back to back.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+//   header block, containing the position and sequence number
+//     of the oldest transaction that may not be installed yet
+//   circular area, holding committed transactions in order:
+//     descriptor block, containing seq and block #s for A, B, C, ...
+//     block A
+//     block B
+//     block C
+//     descriptor block of the next transaction
+//     ...
+// The size of the log comes from the superblock, up to LOGMAX
+// blocks, and a transaction can use up to a quarter of it, so it
+// holds at most (LOGMAX-1)/4 blocks, whose #s fit in one
+// descriptor. LOGMAX is bounded by the buffer cache, since
+// committed blocks stay pinned there until checkpoint().
+//
+// Committing a transaction doesn't write its blocks to their home
+// locations. Instead they stay pinned in the buffer cache until
+// the circular area runs short of space, and then checkpoint()
+// installs the latest committed copy of every logged block and
+// advances the header past all committed transactions. A block
+// that many transactions modify thus goes home once per checkpoint.
+// Recovery replays every committed transaction after the header's
+// position, in order.
+//
+// bfree() tells the log about each block it frees, and once the
+// transaction that frees them has committed, commit() asks the
+// disk to discard them, in runs of consecutive blocks. Not before:
+// until then, a crash would give the blocks back to their files.
+// Not later either: a block freed by one transaction may be
+// reallocated by the next, whose copy of it must not go home
+// until the discard is done; commit() discards before the
+// committer can checkpoint again, so it never does. A freed
+// block's copy that is still waiting for checkpoint() is dead,
+// and isn't installed, unless a later transaction logs the block
+// again.
+
+// Contents of the header block.
+struct loghead {
+  uint tail;  // position of oldest transaction in circular area
+  uint seq;   // its sequence number
+};
+
+#define MAXTRANS ((LOGMAX-1)/4)  // max data blocks in a transaction
+
+// Contents of the descriptor block that starts each transaction,
+// which lists the data blocks' block #s in order. The descriptor
+// and the data blocks go to disk as one request, which the disk
+// may complete in any order, so the checksum tells recovery
+// whether all of them made it.
+#define LOGMAGIC 0x4c4f4721  // "LOG!"
+struct logdesc {
+  uint magic;
+  uint seq;
+  uint sum;   // logsum() of the transaction
+  int n;      // number of data blocks
+  int block[MAXTRANS];
+};
+
+// Block #s of a transaction, kept in memory before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[MAXTRANS];
+};
+
+// Hash index from block # to position in an array of block #s,
+// so that absorbing a block doesn't scan the array.
+#define NLOGHASH 67
+struct logidx {
+  int head[NLOGHASH];  // first position in the bucket, or -1
+  int next[LOGMAX];    // next position in the same bucket, or -1
+  int key[LOGMAX];     // block # at each position
+};
+
+// A block whose latest committed copy hasn't been installed.
+struct logcp {
+  int blockno;
+  uint pos;       // position of the latest committed copy
+  struct buf *b;  // pinned cached block
+  int dead;       // freed since, so don't install it
+};
+
+// A set of freed blocks, a bit per block of the file system,
+// in pages from kalloc(), since the superblock says how many
+// blocks there are.
+#define NFREEPAGE 32
+#define FREEPP    (PGSIZE*8)  // bits per page
+struct freemap {
+  int n;                      // blocks in the set
+  uchar *page[NFREEPAGE];
 };
 
 struct log {
@@ -42,168 +142,660 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may still add.
+  int committing;  // a commit is in progress; don't start another.
+  int closing;     // copying the closed transaction, please wait.
+  int force;       // commit the open transaction as soon as possible.
+  uint opened;     // ticks when the open transaction got its first block.
+  uint closed;     // number of transactions closed since boot.
+  uint done;       // number of those that have committed.
   int dev;
-  struct logheader lh;
+  int max;               // max data blocks in a transaction
+  struct logheader lh;   // the open transaction
+  struct logidx lhidx;   // index of lh.block
+  struct logheader clh;  // the transaction being committed
+
+  // for the transaction being committed:
+  struct buf *lbuf[MAXTRANS];  // locked log blocks holding its copy
+  struct buf *hbuf[MAXTRANS];  // pinned cached home blocks
+  struct buf shadow[MAXTRANS]; // install writes
+  struct buf *ws[1+MAXTRANS];  // for bstartwritev()
+
+  // circular area, in positions relative to its first block.
+  uint head;      // where the next transaction goes
+  uint tail;      // oldest transaction not yet checkpointed
+  uint seq;       // sequence number of the next transaction
+  uint tailseq;   // sequence number of the transaction at tail
+  int ncp;
+  struct logcp cp[LOGMAX];  // blocks to install at checkpoint
+  struct logidx cpidx;      // index of cp[].blockno
+
+  // blocks freed by the open transaction, and by the one
+  // being committed, to discard once it has committed.
+  // they cover blocks below nfmap, which is 0 if the file
+  // system is too big for NFREEPAGE pages or kalloc() ran out.
+  uint nfmap;
+  struct freemap freed;
+  struct freemap cfreed;
 };
 struct log log[NDISK];
 
 static void recover_from_log(int);
+static void checkpoint(int);
+static void snapshot(int);
 static void commit(int);
 
+static void
+idxclear(struct logidx *x)
+{
+  memset(x->head, -1, sizeof(x->head));
+}
+
+// Return the position of blockno in x, or -1.
+static int
+idxfind(struct logidx *x, int blockno)
+{
+  int i;
+
+  for (i = x->head[blockno % NLOGHASH]; i >= 0; i = x->next[i]) {
+    if (x->key[i] == blockno)
+      return i;
+  }
+  return -1;
+}
+
+static void
+idxadd(struct logidx *x, int i, int blockno)
+{
+  x->key[i] = blockno;
+  x->next[i] = x->head[blockno % NLOGHASH];
+  x->head[blockno % NLOGHASH] = i;
+}
+
+static int
+fmget(struct freemap *m, uint b)
+{
+  return (m->page[b / FREEPP][b % FREEPP / 8] >> (b % 8)) & 1;
+}
+
+static void
+fmset(struct freemap *m, uint b, int on)
+{
+  uchar *p = &m->page[b / FREEPP][b % FREEPP / 8];
+
+  if(((*p >> (b % 8)) & 1) == on)
+    return;
+  *p ^= 1 << (b % 8);
+  m->n += on ? 1 : -1;
+}
+
+static void
+fmclear(int dev, struct freemap *m)
+{
+  uint i;
+
+  for(i = 0; i < (log[dev].nfmap + FREEPP - 1) / FREEPP; i++)
+    memset(m->page[i], 0, PGSIZE);
+  m->n = 0;
+}
+
+// Set up the freed-block sets for a file system of size blocks.
+// Without them, nothing is discarded at commit.
+static void
+fminit(int dev, uint size)
+{
+  uint i, np = (size + FREEPP - 1) / FREEPP;
+
+  log[dev].nfmap = 0;
+  if(np > NFREEPAGE)
+    goto bad;
+  for(i = 0; i < 2*np; i++){
+    uchar *p = kalloc();
+    if(p == 0){
+      while(i > 0){
+        i--;
+        kfree(i < np ? log[dev].freed.page[i] : log[dev].cfreed.page[i-np]);
+      }
+      goto bad;
+    }
+    if(i < np)
+      log[dev].freed.page[i] = p;
+    else
+      log[dev].cfreed.page[i-np] = p;
+  }
+  log[dev].nfmap = size;
+  fmclear(dev, &log[dev].freed);
+  fmclear(dev, &log[dev].cfreed);
+  return;
+
+bad:
+  printf("log: can't track freed blocks for discard\n");
+}
+
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  if (sizeof(struct logdesc) > BSIZE)
+    panic("initlog: too big logdesc");
+  if (sb->nlog > LOGMAX || (sb->nlog - 1) / 4 < MAXOPBLOCKS)
+    panic("initlog: bad log size");
+  // filewrite() writes in pieces of half a transaction, each
+  // with at least one data block besides writeextra().
+  if ((sb->nlog - 1) / 4 / 2 <= writeextra(dev))
+    panic("initlog: log too small for the file system");
 
   initlock(&log[dev].lock, "log");
   log[dev].start = sb->logstart;
   log[dev].size = sb->nlog;
+  log[dev].max = (sb->nlog - 1) / 4;
   log[dev].dev = dev;
+  idxclear(&log[dev].lhidx);
+  idxclear(&log[dev].cpidx);
+  fminit(dev, sb->size);
   recover_from_log(dev);
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(int dev)
+// Max # of blocks a begin_op_n() may reserve.
+int
+log_max(int dev)
 {
-  int tail;
+  return log[dev].max;
+}
 
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *lbuf = bread(dev, log[dev].start+tail+1); // read log block
-    struct buf *dbuf = bread(dev, log[dev].lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+// Disk block # of position pos in the circular area.
+static uint
+logblock(int dev, uint pos)
+{
+  return log[dev].start + 1 + pos % (log[dev].size - 1);
+}
+
+// Number of blocks of the circular area in use.
+static uint
+logused(int dev)
+{
+  uint n = log[dev].size - 1;
+
+  return (log[dev].head + n - log[dev].tail) % n;
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk.
 static void
 read_head(int dev)
 {
   struct buf *buf = bread(dev, log[dev].start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log[dev].lh.n = lh->n;
-  for (i = 0; i < log[dev].lh.n; i++) {
-    log[dev].lh.block[i] = lh->block[i];
-  }
+  struct loghead *lh = (struct loghead *) (buf->data);
+  log[dev].tail = lh->tail % (log[dev].size - 1);
+  log[dev].tailseq = lh->seq;
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the log header to disk. Once it is written, the
+// log no longer needs the transactions before tail.
 static void
 write_head(int dev)
 {
-  struct buf *buf = bread(dev, log[dev].start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log[dev].lh.n;
-  for (i = 0; i < log[dev].lh.n; i++) {
-    hb->block[i] = log[dev].lh.block[i];
-  }
+  struct buf *buf = bnew(dev, log[dev].start);
+  struct loghead *hb = (struct loghead *) (buf->data);
+  memset(buf->data, 0, BSIZE);
+  hb->tail = log[dev].tail;
+  hb->seq = log[dev].tailseq;
   bwrite(buf);
   brelse(buf);
 }
 
+// Checksum a transaction: the descriptor d (but not
+// d->sum), the n block #s, and the n data blocks in bs.
+static uint
+logsum(struct logdesc *d, int *block, struct buf **bs, int n)
+{
+  uint h = 2166136261;  // FNV-1a, a 32-bit word at a time
+  uint *p;
+  int i, j;
+
+  h = (h ^ d->magic) * 16777619;
+  h = (h ^ d->seq) * 16777619;
+  h = (h ^ n) * 16777619;
+  for (i = 0; i < n; i++)
+    h = (h ^ block[i]) * 16777619;
+  for (i = 0; i < n; i++) {
+    p = (uint *) bs[i]->data;
+    for (j = 0; j < BSIZE/sizeof(uint); j++)
+      h = (h ^ p[j]) * 16777619;
+  }
+  return h;
+}
+
+// Install the committed transaction whose descriptor is at
+// position pos, if there is one with sequence number seq
+// that made it to disk intact.
+// Returns its length in the circular area, or 0.
+static int
+replay_trans(int dev, uint pos, uint seq)
+{
+  struct buf *buf = bread(dev, logblock(dev, pos));
+  struct logdesc *d = (struct logdesc *) (buf->data);
+  int *block = d->block;
+  int tail, n;
+
+  if (d->magic != LOGMAGIC || d->seq != seq ||
+      d->n < 0 || d->n > log[dev].max || 1 + d->n >= log[dev].size - 1) {
+    brelse(buf);
+    return 0;
+  }
+  n = d->n;
+  for (tail = 0; tail < n; tail++)
+    log[dev].lbuf[tail] = bread(dev, logblock(dev, pos+1+tail));
+  if (logsum(d, block, log[dev].lbuf, n) != d->sum) {
+    // torn: the crash came before the commit finished.
+    for (tail = 0; tail < n; tail++)
+      brelse(log[dev].lbuf[tail]);
+    brelse(buf);
+    return 0;
+  }
+  for (tail = 0; tail < n; tail++) {
+    bshadow(log[dev].lbuf[tail], &log[dev].shadow[tail], block[tail]);
+    log[dev].ws[tail] = &log[dev].shadow[tail];
+  }
+  bstartwritev(log[dev].ws, n);
+  for (tail = 0; tail < n; tail++) {
+    bwait(&log[dev].shadow[tail]);
+    brelse(log[dev].lbuf[tail]);
+  }
+  brelse(buf);
+  return 1 + n;
+}
+
 static void
 recover_from_log(int dev)
 {
+  int len;
+
   read_head(dev);
-  install_trans(dev); // if committed, copy from log to disk
-  log[dev].lh.n = 0;
+  log[dev].head = log[dev].tail;
+  log[dev].seq = log[dev].tailseq;
+  // if committed, copy from log to disk
+  while ((len = replay_trans(dev, log[dev].head, log[dev].seq)) > 0) {
+    log[dev].head = (log[dev].head + len) % (log[dev].size - 1);
+    log[dev].seq++;
+  }
+  log[dev].tail = log[dev].head;
+  log[dev].tailseq = log[dev].seq;
+  bflush(dev);
   write_head(dev); // clear the log
+  bflush(dev);
+}
+
+// Should the open transaction be closed now?
+// Caller holds log[dev].lock.
+static int
+commitdue(int dev)
+{
+  if(log[dev].outstanding > 0 || log[dev].lh.n == 0)
+    return 0;
+  return log[dev].force || log[dev].lh.n >= log[dev].max/2 ||
+    ticks - log[dev].opened >= COMMITTICKS;
 }
 
-// called at the start of each FS system call.
+// Commit transactions while they are due. If another one is
+// due by the time a commit is done, commit that one too.
+// Caller holds log[dev].lock, and no commit is in progress.
+static void
+committer(int dev)
+{
+  log[dev].committing = 1;
+  while(commitdue(dev)){
+    // keep one block free, so that a full log isn't mistaken
+    // for an empty one.
+    if(logused(dev) + 1 + log[dev].lh.n >= log[dev].size - 1){
+      // make room by installing committed blocks. new system
+      // calls can join the transaction in the meantime.
+      release(&log[dev].lock);
+      checkpoint(dev);
+      acquire(&log[dev].lock);
+      continue;
+    }
+    // close the transaction. begin_op() waits until
+    // snapshot() has copied it, so no system call can
+    // modify its blocks in the meantime.
+    log[dev].closing = 1;
+    log[dev].force = 0;
+    // inodes that changed after their first iupdate() in the
+    // transaction go into their (already logged) blocks.
+    release(&log[dev].lock);
+    iflushdirty(dev);
+    acquire(&log[dev].lock);
+    log[dev].closed++;
+    log[dev].clh = log[dev].lh;
+    log[dev].lh.n = 0;
+    idxclear(&log[dev].lhidx);
+    // discard_trans() has emptied cfreed, so swapping the
+    // sets leaves an empty one for the new transaction.
+    struct freemap fm = log[dev].cfreed;
+    log[dev].cfreed = log[dev].freed;
+    log[dev].freed = fm;
+    release(&log[dev].lock);
+    // call snapshot() and commit() w/o holding locks,
+    // since not allowed to sleep with locks.
+    snapshot(dev);
+    acquire(&log[dev].lock);
+    log[dev].closing = 0;
+    wakeup(&log);
+    release(&log[dev].lock);
+
+    commit(dev);
+    acquire(&log[dev].lock);
+    log[dev].done++;
+    wakeup(&log);  // log_force() may be waiting
+  }
+  log[dev].committing = 0;
+  wakeup(&log);
+}
+
+// called at the start of each FS system call that
+// writes at most nblocks distinct blocks.
 void
-begin_op(int dev)
+begin_op_n(int dev, int nblocks)
 {
+  if(nblocks > log[dev].max)
+    panic("begin_op_n");
+
   acquire(&log[dev].lock);
   while(1){
-    if(log[dev].committing){
-      sleep(&log, &log[dev].lock);
-    } else if(log[dev].lh.n + (log[dev].outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    if(log[dev].closing){
       sleep(&log, &log[dev].lock);
+    } else if(log[dev].lh.n + log[dev].reserved + nblocks > log[dev].max){
+      // this op might exhaust log space; commit, or
+      // wait for a commit.
+      log[dev].force = 1;
+      if(!log[dev].committing && commitdue(dev))
+        committer(dev);
+      else
+        sleep(&log, &log[dev].lock);
     } else {
       log[dev].outstanding += 1;
+      log[dev].reserved += nblocks;
+      myproc()->logres = nblocks;
       release(&log[dev].lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call that
+// doesn't say how many blocks it writes.
+void
+begin_op(int dev)
+{
+  begin_op_n(dev, MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// if this was the last outstanding operation and the
+// transaction is due, commits it, unless a commit is
+// already in progress, in which case that commit will
+// pick this transaction up when it is done.
 void
 end_op(int dev)
 {
-  int do_commit = 0;
-
   acquire(&log[dev].lock);
   log[dev].outstanding -= 1;
-  if(log[dev].committing)
-    panic("log[dev].committing");
-  if(log[dev].outstanding == 0){
-    do_commit = 1;
-    log[dev].committing = 1;
+  log[dev].reserved -= myproc()->logres;
+  myproc()->logres = 0;
+  if(log[dev].closing)
+    panic("log[dev].closing");
+  if(!log[dev].committing && commitdue(dev)){
+    committer(dev);
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log[dev].outstanding has decreased
-    // the amount of reserved space.
+    // and this op's unused reservation is free again.
     wakeup(&log);
   }
   release(&log[dev].lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit(dev);
-    acquire(&log[dev].lock);
-    log[dev].committing = 0;
-    wakeup(&log);
-    release(&log[dev].lock);
+// Wait until every FS system call that has finished so far
+// has committed. For fsync().
+void
+log_force(int dev)
+{
+  uint target;
+
+  // joining the open transaction keeps it from closing
+  // while the target is computed.
+  begin_op_n(dev, 0);
+  acquire(&log[dev].lock);
+  target = log[dev].closed;
+  if(log[dev].lh.n > 0){
+    target++;
+    log[dev].force = 1;
+  }
+  release(&log[dev].lock);
+  end_op(dev);
+
+  acquire(&log[dev].lock);
+  while(log[dev].done < target)
+    sleep(&log, &log[dev].lock);
+  release(&log[dev].lock);
+}
+
+// The log flusher process. Commits transactions that have
+// been open for COMMITTICKS, since no system call might come
+// along to do it. Checks about twice per COMMITTICKS.
+void
+logflusher(void)
+{
+  int dev;
+  uint ticks0;
+
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  for(;;){
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while(ticks - ticks0 < COMMITTICKS/2 + 1)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    for(dev = 0; dev < NDISK; dev++){
+      if(log[dev].size == 0)  // no file system
+        continue;
+      acquire(&log[dev].lock);
+      if(!log[dev].committing && commitdue(dev))
+        committer(dev);
+      release(&log[dev].lock);
+    }
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the closed transaction's blocks from cache to the log
+// buffers of the positions following the head. The cached blocks
+// stay pinned until checkpoint() installs them.
 static void
-write_log(int dev)
+snapshot(int dev)
 {
   int tail;
 
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *to = bread(dev, log[dev].start+tail+1); // log block
-    struct buf *from = bread(dev, log[dev].lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (tail = 0; tail < log[dev].clh.n; tail++) {
+    log[dev].lbuf[tail] = bnew(dev, logblock(dev, log[dev].head+1+tail));
+    struct buf *from = bread(dev, log[dev].clh.block[tail]); // cache block
+    memmove(log[dev].lbuf[tail]->data, from->data, BSIZE);
+    log[dev].hbuf[tail] = from;
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write the descriptor and the log buffers to the log, as a single
+// disk request unless the transaction wraps around the end of the
+// circular area, and flush the disk's write cache.
+// This is the true point at which the transaction commits.
 static void
-commit(int dev)
+write_log(int dev)
 {
-  if (log[dev].lh.n > 0) {
-    write_log(dev);     // Write modified blocks from cache to log
-    write_head(dev);    // Write header to disk -- the real commit
-    install_trans(dev); // Now install writes to home locations
-    log[dev].lh.n = 0;
-    write_head(dev);    // Erase the transaction from the log
+  struct buf *dbuf;
+  struct logdesc *d;
+  int tail, n = log[dev].clh.n;
+
+  dbuf = bnew(dev, logblock(dev, log[dev].head));
+  d = (struct logdesc *) (dbuf->data);
+  memset(d, 0, BSIZE);
+  d->magic = LOGMAGIC;
+  d->seq = log[dev].seq;
+  d->n = n;
+  for (tail = 0; tail < n; tail++)
+    d->block[tail] = log[dev].clh.block[tail];
+  d->sum = logsum(d, d->block, log[dev].lbuf, n);
+
+  log[dev].ws[0] = dbuf;
+  for (tail = 0; tail < n; tail++)
+    log[dev].ws[1+tail] = log[dev].lbuf[tail];
+  bstartwritev(log[dev].ws, 1 + n);
+  bwait(dbuf);
+  for (tail = 0; tail < n; tail++)
+    bwait(log[dev].lbuf[tail]);
+  bflush(dev);
+  brelse(dbuf);
+}
+
+// Does the open transaction have uncommitted changes to blockno?
+static int
+logdirty(int dev, int blockno)
+{
+  int dirty;
+
+  acquire(&log[dev].lock);
+  dirty = idxfind(&log[dev].lhidx, blockno) >= 0;
+  release(&log[dev].lock);
+  return dirty;
+}
+
+// Install the latest committed copy of every block logged since
+// the last checkpoint, then advance the tail to the head.
+// Called by the committer between transactions.
+// A cached block that a later transaction hasn't touched is its
+// latest committed copy, so install it from there; otherwise read
+// the committed copy back from the log. Either way the write goes
+// out through a log buffer, so that the committer never waits for
+// a home block while holding another one. The writes go out in
+// batches, merging runs of consecutive home blocks.
+static void
+checkpoint(int dev)
+{
+  int i, k, m, n;
+  struct logcp *c;
+  struct buf *b;
+
+  for (i = 0; i < log[dev].ncp; i += n) {
+    n = log[dev].ncp - i;
+    if (n > log[dev].max)
+      n = log[dev].max;
+    m = 0;
+    for (k = 0; k < n; k++) {
+      c = &log[dev].cp[i+k];
+      if (c->dead)
+        continue;
+      b = bread(dev, c->blockno);  // pinned, so no disk read
+      if (logdirty(dev, c->blockno)) {
+        brelse(b);
+        log[dev].lbuf[m] = bread(dev, logblock(dev, c->pos));
+      } else {
+        log[dev].lbuf[m] = bnew(dev, logblock(dev, c->pos));
+        memmove(log[dev].lbuf[m]->data, b->data, BSIZE);
+        brelse(b);
+      }
+      bshadow(log[dev].lbuf[m], &log[dev].shadow[m], c->blockno);
+      log[dev].ws[m] = &log[dev].shadow[m];
+      m++;
+    }
+    bstartwritev(log[dev].ws, m);
+    for (k = 0; k < m; k++) {
+      bwait(&log[dev].shadow[k]);
+      brelse(log[dev].lbuf[k]);
+    }
+    for (k = 0; k < n; k++)
+      bunpin(log[dev].cp[i+k].b);
   }
+  log[dev].ncp = 0;
+  idxclear(&log[dev].cpidx);
+  log[dev].tail = log[dev].head;
+  log[dev].tailseq = log[dev].seq;
+  bflush(dev);      // installs must be durable before the header
+  write_head(dev);
+  bflush(dev);      // and the header before the log is reused
+}
+
+// Remember where the committed transaction put each block, so
+// that checkpoint() can install it. A block already waiting for
+// checkpoint keeps a single pin in the cache.
+static void
+record_trans(int dev)
+{
+  int tail, i, blockno;
+  struct logcp *c;
+
+  for (tail = 0; tail < log[dev].clh.n; tail++) {
+    blockno = log[dev].clh.block[tail];
+    if ((i = idxfind(&log[dev].cpidx, blockno)) < 0) {
+      i = log[dev].ncp++;
+      idxadd(&log[dev].cpidx, i, blockno);
+      log[dev].cp[i].blockno = blockno;
+      log[dev].cp[i].b = log[dev].hbuf[tail];
+    } else {
+      bunpin(log[dev].hbuf[tail]);
+    }
+    c = &log[dev].cp[i];
+    c->pos = (log[dev].head + 1 + tail) % (log[dev].size - 1);
+    c->dead = 0;
+  }
+}
+
+// Discard the blocks that the committed transaction freed.
+// A freed block that is waiting for checkpoint() is dead, so
+// installing it would only undo the discard.
+static void
+discard_trans(int dev)
+{
+  struct freemap *m = &log[dev].cfreed;
+  uint b, start, n = log[dev].nfmap;
+  int i;
+
+  if(m->n == 0)
+    return;
+  for(b = 0; b < n; b++){
+    if(!fmget(m, b))
+      continue;
+    for(start = b; ; b++){
+      if((i = idxfind(&log[dev].cpidx, b)) >= 0)
+        log[dev].cp[i].dead = 1;
+      if(b+1 >= n || !fmget(m, b+1))
+        break;
+    }
+    bdiscard(dev, start, b - start + 1);
+  }
+  acquire(&log[dev].lock);
+  fmclear(dev, m);
+  release(&log[dev].lock);
+}
+
+static void
+commit(int dev)
+{
+  int tail, n;
+
+  n = log[dev].clh.n;
+  write_log(dev);       // Write descriptor and blocks to log -- the real commit
+  record_trans(dev);
+  log[dev].head = (log[dev].head + 1 + n) % (log[dev].size - 1);
+  log[dev].seq++;
+  log[dev].clh.n = 0;
+  for (tail = 0; tail < n; tail++)
+    brelse(log[dev].lbuf[tail]);
+  discard_trans(dev);
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// snapshot() and commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -214,24 +806,71 @@ void
 log_write(struct buf *b)
 {
   int i;
+  struct proc *p = myproc();
 
   int dev = b->dev;
-  if (log[dev].lh.n >= LOGSIZE || log[dev].lh.n >= log[dev].size - 1)
+  if (log[dev].lh.n >= log[dev].max)
     panic("too big a transaction");
   if (log[dev].outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log[dev].lock);
-  for (i = 0; i < log[dev].lh.n; i++) {
-    if (log[dev].lh.block[i] == b->blockno)   // log absorbtion
-      break;
-  }
-  log[dev].lh.block[i] = b->blockno;
-  if (i == log[dev].lh.n) {  // Add new block to log?
+  i = idxfind(&log[dev].lhidx, b->blockno);  // log absorbtion
+  if (i < 0) {  // Add new block to log?
+    i = log[dev].lh.n;
+    log[dev].lh.block[i] = b->blockno;
+    idxadd(&log[dev].lhidx, i, b->blockno);
     bpin(b);
+    if (log[dev].lh.n == 0)
+      log[dev].opened = ticks;
     log[dev].lh.n++;
+    if (p->logres > 0) {
+      p->logres--;
+      log[dev].reserved--;
+    }
   }
   release(&log[dev].lock);
 }
 
+// bfree() has freed blockno in the open transaction, so it can
+// be discarded once the transaction commits. Caller holds the
+// lock on the bitmap block, as for log_unfree() and log_freed().
+void
+log_free(int dev, uint blockno)
+{
+  if(blockno >= log[dev].nfmap)
+    return;
+  acquire(&log[dev].lock);
+  fmset(&log[dev].freed, blockno, 1);
+  release(&log[dev].lock);
+}
+
+// balloc() has allocated blockno; don't discard it if the open
+// transaction freed it. If the transaction being committed freed
+// it, the discard will be done before the new contents go home.
+void
+log_unfree(int dev, uint blockno)
+{
+  if(blockno >= log[dev].nfmap)
+    return;
+  acquire(&log[dev].lock);
+  fmset(&log[dev].freed, blockno, 0);
+  release(&log[dev].lock);
+}
+
+// Has a transaction that hasn't committed yet freed blockno?
+// If so, a crash could still give it back to its file.
+// Answers yes for a block the freed sets don't cover, since
+// there is no telling.
+int
+log_freed(int dev, uint blockno)
+{
+  int freed;
 
+  if(blockno >= log[dev].nfmap)
+    return 1;
+  acquire(&log[dev].lock);
+  freed = fmget(&log[dev].freed, blockno) || fmget(&log[dev].cfreed, blockno);
+  release(&log[dev].lock);
+  return freed;
+}
@@ -2,13 +2,18 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // minimum size of i-node cache
+#define NINODEMAX   400  // high-water mark of i-node cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       0  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGBLOCKS    (MAXOPBLOCKS*12+1)  // size of on-disk log made by mkfs
+#define LOGMAX       (NBUFMAX/2)  // max size of on-disk log (pinned in cache)
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define NBUFMAX      512   // high-water mark of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
+#define COMMITTICKS  10  // max ticks a log transaction stays open
+#define POLLCYCLES   10000  // max cycles to poll for a disk request (1ms)
 #define MAXPATH      128   // maximum file path name
 #define NDISK        2
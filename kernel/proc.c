@@ -221,6 +221,22 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel process that runs fn(), for housekeeping
+// like the log flusher. fn() starts out holding p->lock,
+// like forkret(), and never returns.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc");
+  p->context.ra = (uint64)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -334,7 +350,7 @@ exit(int status)
     }
   }
 
-  begin_op(ROOTDEV);
+  begin_op_n(ROOTDEV, iputblocks(ROOTDEV));
   iput(p->cwd);
   end_op(ROOTDEV);
   p->cwd = 0;
@@ -541,6 +557,7 @@ forkret(void)
     // be run from main().
     first = 0;
     fsinit(minor(ROOTDEV));
+    kproc("logflush", logflusher);
   }
 
   usertrapret();
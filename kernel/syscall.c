@@ -105,6 +105,11 @@ extern uint64 sys_wait(void);
 extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_ntas(void);
+extern uint64 sys_iostat(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_fdatasync(void);
+extern uint64 sys_iopoll(void);
+extern uint64 sys_fstrim(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -129,6 +134,11 @@ static uint64 (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_ntas]    sys_ntas,
+[SYS_iostat]  sys_iostat,
+[SYS_fsync]   sys_fsync,
+[SYS_fdatasync] sys_fdatasync,
+[SYS_iopoll]  sys_iopoll,
+[SYS_fstrim]  sys_fstrim,
 };
 
 void
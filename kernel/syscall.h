@@ -23,3 +23,8 @@
 
 // System calls for labs
 #define SYS_ntas   22
+#define SYS_iostat 23
+#define SYS_fsync  24
+#define SYS_fdatasync 25
+#define SYS_iopoll 26
+#define SYS_fstrim 27
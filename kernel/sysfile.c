@@ -115,6 +115,41 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Make the file's changes durable. System calls commit
+// lazily (see log.c), so this waits for the commit of every
+// system call that has finished, which includes every
+// write to f.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+    return -1;
+  log_force(f->ip->dev);
+  return 0;
+}
+
+// Like fsync(). Metadata goes through the same log as data,
+// so there is nothing cheaper to do.
+uint64
+sys_fdatasync(void)
+{
+  return sys_fsync();
+}
+
+// Discard the file system's free blocks, so that the disk can
+// reclaim their space. Frees that haven't committed are left to
+// the commit, which discards what it frees anyway; this is for
+// blocks freed before the disk could discard, or before boot.
+// Returns the number of blocks discarded, or -1 if the disk
+// can't discard.
+uint64
+sys_fstrim(void)
+{
+  return btrim(ROOTDEV);
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -165,27 +200,10 @@ bad:
   return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int
-isdirempty(struct inode *dp)
-{
-  int off;
-  struct dirent de;
-
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
-  }
-  return 1;
-}
-
 uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
@@ -210,14 +228,12 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && !dirempty(ip)){
     iunlockput(ip);
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, name, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -258,7 +274,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0)
     panic("create: ialloc");
 
   ilock(ip);
@@ -275,8 +291,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  if(dirlink(dp, name, ip->inum) < 0){
+    // dp is full: undo.
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
 
@@ -295,7 +321,10 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op(ROOTDEV);
+  if(omode & O_CREATE)
+    begin_op(ROOTDEV);
+  else
+    begin_op_n(ROOTDEV, iputblocks(ROOTDEV));
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -339,6 +368,7 @@ sys_open(void)
   }
   f->ip = ip;
   f->off = 0;
+  memset(&f->ra, 0, sizeof(f->ra));
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
 
@@ -391,7 +421,8 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *p = myproc();
   
-  begin_op(ROOTDEV);
+  // namei() and iput() write only if they free an inode.
+  begin_op_n(ROOTDEV, 2*iputblocks(ROOTDEV));
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op(ROOTDEV);
     return -1;
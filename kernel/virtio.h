@@ -27,6 +27,13 @@
 #define VIRTIO_MMIO_INTERRUPT_STATUS	0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	0x064 // write-only
 #define VIRTIO_MMIO_STATUS		0x070 // read/write
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific config
+
+// offset of the 32-bit word of struct virtio_blk_config whose
+// high 16 bits are num_queues.
+#define VIRTIO_BLK_CONFIG_NUMQ		0x20
+// offset of max_discard_sectors.
+#define VIRTIO_BLK_CONFIG_MAXDISCARD	0x24
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -37,15 +44,22 @@
 // device feature bits
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
+#define VIRTIO_BLK_F_FLUSH           9	/* Cache flush command support */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
+#define VIRTIO_BLK_F_DISCARD        13	/* Discard command support */
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// this many virtio descriptors, enough for NUM/3 requests in flight,
+// or NUM with indirect descriptors.
+// must be a power of two, and small enough for the descriptors
+// and the avail ring to fit in one page.
+#define NUM 64
+
+// descriptors in an indirect table: a header, 32 blocks, a status.
+#define NINDIRECT 34
 
 struct VRingDesc {
   uint64 addr;
@@ -55,6 +69,7 @@ struct VRingDesc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
 struct VRingUsedElem {
   uint32 id;   // index of start of completed descriptor chain
@@ -64,9 +79,31 @@ struct VRingUsedElem {
 // for disk ops
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_FLUSH 4 // flush the disk's write cache
+#define VIRTIO_BLK_T_DISCARD 11 // forget a range of sectors
+
+// the first descriptor of each disk request points to one of these.
+struct virtio_blk_outhdr {
+  uint32 type;
+  uint32 reserved;
+  uint64 sector;
+};
+
+// the data of a discard request is an array of these.
+struct virtio_blk_discard {
+  uint64 sector;
+  uint32 num_sectors;
+  uint32 flags;
+};
 
 struct UsedArea {
   uint16 flags;
   uint16 id;
   struct VRingUsedElem elems[NUM];
+  uint16 avail_event; // with EVENT_IDX, device wants a notify at this avail idx
 };
+
+// with EVENT_IDX, should the driver notify (or the device interrupt)
+// for event index ev, now that its index has moved from old to new?
+#define VRING_NEED_EVENT(ev, new, old) \
+  ((uint16)((new) - (ev) - 1) < (uint16)((new) - (old)))
@@ -3,7 +3,7 @@
 // uses qemu's mmio interface to virtio.
 // qemu presents a "legacy" virtio interface.
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0,discard=unmap -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=N
 //
 
 #include "types.h"
@@ -20,20 +20,23 @@
 // the address of virtio mmio register r.
 #define R(n, r) ((volatile uint32 *)(VIRTION(n) + (r)))
 
-struct disk {
-  // memory for virtio descriptors &c for queue 0.
+// a virtqueue, with its own lock, so that harts submitting
+// on different queues don't contend.
+struct vq {
+  // memory for virtio descriptors &c for the queue.
   // this is a global instead of allocated because it has
   // to be multiple contiguous pages, which kalloc()
   // doesn't support.
   char pages[2*PGSIZE];
-  
+
   struct VRingDesc *desc;
   uint16 *avail;
   struct UsedArea *used;
 
   // our own book-keeping.
+  int id;          // queue number
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 used_idx; // we've looked this far in used->elems, mod 2^16.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -41,20 +44,82 @@ struct disk {
   struct {
     struct buf *b;
     char status;
+    char write;
   } info[NUM];
 
+  // request headers, indexed like info[]. they can't live on the
+  // submitter's stack, since requests outlive the call.
+  struct virtio_blk_outhdr ops[NUM];
+
+  // indirect descriptor tables, indexed like info[].
+  struct VRingDesc ind[NUM][NINDIRECT];
+
+  // the range of each discard request, indexed like info[].
+  struct virtio_blk_discard seg[NUM];
+
+  struct spinlock lock;
+} __attribute__ ((aligned (PGSIZE)));
+
+struct disk {
+  // with VIRTIO_BLK_F_MQ, one queue per hart, up to NCPU;
+  // hart i submits on queue i % nvq.
+  struct vq vq[NCPU];
+  int nvq;
+
   // initialized?
   int init;
 
-  struct spinlock vdisk_lock;
-} __attribute__ ((aligned (PGSIZE))) disk[NDISK];
-  
+  // does the device have a write cache that needs flushing?
+  int flush;
+
+  // should virtio_disk_wait() poll for completion?
+  int poll;
+
+  // negotiated VIRTIO_RING_F_EVENT_IDX and VIRTIO_RING_F_INDIRECT_DESC?
+  int eventidx;
+  int indirect;
+
+  // with VIRTIO_BLK_F_DISCARD, the most blocks one discard may
+  // cover, else 0.
+  uint maxdiscard;
+} disk[NDISK];
+
+// request latency, from submission until virtio_disk_wait()
+// returns, for each way a waiter can learn of completion.
+#define LPOLL     0  // polled, and saw the request finish
+#define LFALLBACK 1  // polled for POLLCYCLES, then slept
+#define LINTR     2  // slept until the interrupt
+#define NLAT      3
+
+static char *latname[NLAT] = {
+[LPOLL]     "polled",
+[LFALLBACK] "fallback",
+[LINTR]     "interrupt",
+};
+
+static struct {
+  uint64 n;
+  uint64 sum;   // cycles
+  uint64 max;
+} lat[NLAT];
+
+// the queue that the calling hart submits on.
+static struct vq*
+myvq(int n)
+{
+  int id;
 
+  push_off();
+  id = cpuid();
+  pop_off();
+  return &disk[n].vq[id % disk[n].nvq];
+}
 
 void
 virtio_disk_init(int n)
 {
   uint32 status = 0;
+  struct vq *q;
 
   __sync_synchronize();
   if(disk[n].init)
@@ -62,8 +127,6 @@ virtio_disk_init(int n)
 
   printf("virtio disk init %d\n", n);
   
-  initlock(&disk[n].vdisk_lock, "virtio_disk");
-
   if(*R(n, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(n, VIRTIO_MMIO_VERSION) != 1 ||
      *R(n, VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -82,11 +145,27 @@ virtio_disk_init(int n)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(n, VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk[n].flush = (features & (1 << VIRTIO_BLK_F_FLUSH)) != 0;
+  disk[n].eventidx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
+  disk[n].indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+
+  // can the device discard, and how much at once?
+  disk[n].maxdiscard = 0;
+  if(features & (1 << VIRTIO_BLK_F_DISCARD))
+    disk[n].maxdiscard =
+      *R(n, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_MAXDISCARD) / (BSIZE / 512);
+
+  // how many queues? num_queues is a 16-bit field of the config.
+  disk[n].nvq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    disk[n].nvq = (*R(n, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUMQ) >> 16) & 0xffff;
+    if(disk[n].nvq > NCPU)
+      disk[n].nvq = NCPU;
+    if(disk[n].nvq < 1)
+      disk[n].nvq = 1;
+  }
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -98,27 +177,31 @@ virtio_disk_init(int n)
 
   *R(n, VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
-  // initialize queue 0.
-  *R(n, VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(n, VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(n, VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk[n].pages, 0, sizeof(disk[n].pages));
-  *R(n, VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk[n].pages) >> PGSHIFT;
-
-  // desc = pages -- num * VRingDesc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-
-  disk[n].desc = (struct VRingDesc *) disk[n].pages;
-  disk[n].avail = (uint16*)(((char*)disk[n].desc) + NUM*sizeof(struct VRingDesc));
-  disk[n].used = (struct UsedArea *) (disk[n].pages + PGSIZE);
-
-  for(int i = 0; i < NUM; i++)
-    disk[n].free[i] = 1;
+  // initialize the queues.
+  for(q = disk[n].vq; q < disk[n].vq + disk[n].nvq; q++){
+    q->id = q - disk[n].vq;
+    initlock(&q->lock, "virtio_disk");
+    *R(n, VIRTIO_MMIO_QUEUE_SEL) = q->id;
+    uint32 max = *R(n, VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if(max == 0)
+      panic("virtio disk has no queue");
+    if(max < NUM)
+      panic("virtio disk max queue too short");
+    *R(n, VIRTIO_MMIO_QUEUE_NUM) = NUM;
+    memset(q->pages, 0, sizeof(q->pages));
+    *R(n, VIRTIO_MMIO_QUEUE_PFN) = ((uint64)q->pages) >> PGSHIFT;
+
+    // desc = pages -- num * VRingDesc
+    // avail = pages + 0x40 -- 2 * uint16, then num * uint16
+    // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+
+    q->desc = (struct VRingDesc *) q->pages;
+    q->avail = (uint16*)(((char*)q->desc) + NUM*sizeof(struct VRingDesc));
+    q->used = (struct UsedArea *) (q->pages + PGSIZE);
+
+    for(int i = 0; i < NUM; i++)
+      q->free[i] = 1;
+  }
 
   disk[n].init = 1;
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
@@ -126,11 +209,11 @@ virtio_disk_init(int n)
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc(int n)
+alloc_desc(struct vq *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk[n].free[i]){
-      disk[n].free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -139,144 +222,390 @@ alloc_desc(int n)
 
 // mark a descriptor as free.
 static void
-free_desc(int n, int i)
+free_desc(struct vq *q, int i)
 {
   if(i >= NUM)
     panic("virtio_disk_intr 1");
-  if(disk[n].free[i])
+  if(q->free[i])
     panic("virtio_disk_intr 2");
-  disk[n].desc[i].addr = 0;
-  disk[n].free[i] = 1;
-  wakeup(&disk[n].free[0]);
+  q->desc[i].addr = 0;
+  q->free[i] = 1;
+  wakeup(&q->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int n, int i)
+free_chain(struct vq *q, int i)
 {
   while(1){
-    free_desc(n, i);
-    if(disk[n].desc[i].flags & VRING_DESC_F_NEXT)
-      i = disk[n].desc[i].next;
+    free_desc(q, i);
+    if(q->desc[i].flags & VRING_DESC_F_NEXT)
+      i = q->desc[i].next;
     else
       break;
   }
 }
 
+// allocate cnt descriptors, which need not be contiguous.
 static int
-alloc3_desc(int n, int *idx)
+allocn_desc(struct vq *q, int *idx, int cnt)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc(n);
+  for(int i = 0; i < cnt; i++){
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(n, idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(int n, struct buf *b, int write)
+// with EVENT_IDX, the index in used->elems at which we want the
+// next interrupt; it follows the avail ring.
+static uint16*
+used_event(struct vq *q)
+{
+  return &q->avail[2 + NUM];
+}
+
+// how many ring descriptors does a request for nb bufs take?
+// one, pointing to an indirect table, if the device allows it.
+static int
+ndesc(int n, int nb)
+{
+  if(disk[n].indirect && nb + 2 <= NINDIRECT)
+    return 1;
+  return nb + 2;
+}
+
+// format the descriptors for a request of the given type covering
+// the bufs in bs, which are for consecutive blocks, and hand them
+// to the device. idx holds the ndesc(n, nb) ring descriptors, or,
+// for a discard, which has no bufs, the ndesc(n, 1) descriptors
+// for its segment, which the caller has filled in.
+// caller holds q->lock.
+static void
+virtio_disk_start(int n, struct vq *q, struct buf **bs, int nb, int type, int *idx)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = nb > 0 ? bs[0]->blockno * (BSIZE / 512) : 0;
+  struct VRingDesc *d = q->desc;
+  int nd = type == VIRTIO_BLK_T_DISCARD ? 1 : nb;  // data descriptors
+  int head = idx[0];
+  int ind[NINDIRECT];
+  uint16 old;
+  int i;
+
+  // the spec says that legacy block operations use a
+  // descriptor for type/reserved/sector, one for each
+  // piece of data, and one for a 1-byte status result.
+  // with indirect descriptors, these go in a table of
+  // their own, and the ring holds one descriptor for it.
+  if(ndesc(n, nd) == 1){
+    d = q->ind[head];
+    for(i = 0; i < nd + 2; i++)
+      ind[i] = i;
+    idx = ind;
+    q->desc[head].addr = (uint64) d;
+    q->desc[head].len = (nd + 2) * sizeof(struct VRingDesc);
+    q->desc[head].flags = VRING_DESC_F_INDIRECT;
+    q->desc[head].next = 0;
+  }
 
-  acquire(&disk[n].vdisk_lock);
+  // format the descriptors.
+  // qemu's virtio-blk.c reads them.
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  struct virtio_blk_outhdr *buf0 = &q->ops[head];
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(n, idx) == 0) {
-      break;
+  buf0->type = type;
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  d[idx[0]].addr = (uint64) buf0;
+  d[idx[0]].len = sizeof(*buf0);
+  d[idx[0]].flags = VRING_DESC_F_NEXT;
+  d[idx[0]].next = idx[1];
+
+  for(i = 0; i < nd; i++){
+    if(type == VIRTIO_BLK_T_DISCARD){
+      d[idx[i+1]].addr = (uint64) &q->seg[head];
+      d[idx[i+1]].len = sizeof(q->seg[head]);
+    } else {
+      d[idx[i+1]].addr = (uint64) bs[i]->data;
+      d[idx[i+1]].len = BSIZE;
     }
-    sleep(&disk[n].free[0], &disk[n].vdisk_lock);
+    if(type == VIRTIO_BLK_T_IN)
+      d[idx[i+1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    else
+      d[idx[i+1]].flags = 0; // device reads b->data
+    d[idx[i+1]].flags |= VRING_DESC_F_NEXT;
+    d[idx[i+1]].next = idx[i+2];
   }
-  
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
-
-  if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk[n].desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk[n].desc[idx[0]].len = sizeof(buf0);
-  disk[n].desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk[n].desc[idx[0]].next = idx[1];
-
-  disk[n].desc[idx[1]].addr = (uint64) b->data;
-  disk[n].desc[idx[1]].len = BSIZE;
-  if(write)
-    disk[n].desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk[n].desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk[n].desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk[n].desc[idx[1]].next = idx[2];
-
-  disk[n].info[idx[0]].status = 0;
-  disk[n].desc[idx[2]].addr = (uint64) &disk[n].info[idx[0]].status;
-  disk[n].desc[idx[2]].len = 1;
-  disk[n].desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk[n].desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk[n].info[idx[0]].b = b;
+  q->info[head].status = 0;
+  d[idx[nd+1]].addr = (uint64) &q->info[head].status;
+  d[idx[nd+1]].len = 1;
+  d[idx[nd+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[idx[nd+1]].next = 0;
+
+  // record the struct bufs for virtio_disk_intr().
+  for(i = 0; i < nb; i++){
+    bs[i]->disk = 1;
+    bs[i]->vq = q->id;
+    bs[i]->stime = r_time();
+    bs[i]->dnext = i+1 < nb ? bs[i+1] : 0;
+  }
+  q->info[head].b = nb > 0 ? bs[0] : 0;
+  q->info[head].write = type != VIRTIO_BLK_T_IN;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
   // avail[2...] are desc[] indices the device should process.
   // we only tell device the first index in our chain of descriptors.
-  disk[n].avail[2 + (disk[n].avail[1] % NUM)] = idx[0];
+  old = q->avail[1];
+  q->avail[2 + (old % NUM)] = head;
   __sync_synchronize();
-  disk[n].avail[1] = disk[n].avail[1] + 1;
+  q->avail[1] = old + 1;
+  __sync_synchronize();
+
+  // with EVENT_IDX, the device says how far it has got, and
+  // doesn't need telling while it is still working through
+  // requests queued before this one.
+  if(disk[n].eventidx && !VRING_NEED_EVENT(q->used->avail_event, old + 1, old))
+    return;
+  *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = q->id; // value is queue number
+}
+
+// allocate cnt descriptors for a request, sleeping until they
+// are free.
+// caller holds q->lock.
+static void
+virtio_disk_alloc(struct vq *q, int *idx, int cnt)
+{
+  while(allocn_desc(q, idx, cnt) < 0)
+    sleep(&q->free[0], &q->lock);
+}
+
+// Queue a request to read or write the nb bufs in bs, which must
+// be for consecutive blocks, and return without waiting for it,
+// so that callers can keep many requests in flight. Sleeps until
+// descriptors are free. When the request is done, each buf
+// completes as if it had been submitted alone: virtio_disk_reap()
+// clears b->disk, sets b->valid after a read, wakes up
+// virtio_disk_wait(), and calls b->iodone(b) if it is set.
+void
+virtio_disk_submitv(int n, struct buf **bs, int nb, int write)
+{
+  int idx[NUM];
+  struct vq *q;
+
+  if(nb < 1 || ndesc(n, nb) > NUM)
+    panic("virtio_disk_submitv");
+  for(int i = 1; i < nb; i++)
+    if(bs[i]->blockno != bs[0]->blockno + i)
+      panic("virtio_disk_submitv: not consecutive");
+
+  q = myvq(n);
+  acquire(&q->lock);
+  virtio_disk_alloc(q, idx, ndesc(n, nb));
+  virtio_disk_start(n, q, bs, nb, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, idx);
+  release(&q->lock);
+}
 
-  *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// Queue a request to flush the disk's write cache, so that
+// every write that has completed is durable when it finishes.
+// b, which holds no data, tracks the request like any other,
+// for virtio_disk_wait(). If the disk has no write cache,
+// there is nothing to do, and b is done immediately.
+void
+virtio_disk_flush(int n, struct buf *b)
+{
+  int idx[2];
+  struct vq *q;
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk[n].vdisk_lock);
+  b->dnext = 0;
+  b->stime = r_time();
+  if(!disk[n].flush){
+    b->disk = 0;
+    return;
   }
+  q = myvq(n);
+  acquire(&q->lock);
+  virtio_disk_alloc(q, idx, ndesc(n, 0));
+  virtio_disk_start(n, q, 0, 0, VIRTIO_BLK_T_FLUSH, idx);
+  b->disk = 1;
+  b->vq = q->id;
+  q->info[idx[0]].b = b;
+  release(&q->lock);
+}
 
-  disk[n].info[idx[0]].b = 0;
-  free_chain(n, idx[0]);
+// Queue a request to discard nblocks blocks starting at blockno,
+// telling the device that they hold nothing of use, so that it
+// can reclaim their space. b tracks the request, as for
+// virtio_disk_flush(). The device may limit how much one request
+// covers; returns how many blocks, from blockno on, this one does,
+// or 0, with b done immediately, if the device can't discard.
+uint
+virtio_disk_discard(int n, struct buf *b, uint blockno, uint nblocks)
+{
+  int idx[3];
+  struct vq *q;
 
-  release(&disk[n].vdisk_lock);
+  b->dnext = 0;
+  b->stime = r_time();
+  if(disk[n].maxdiscard == 0){
+    b->disk = 0;
+    return 0;
+  }
+  if(nblocks > disk[n].maxdiscard)
+    nblocks = disk[n].maxdiscard;
+  q = myvq(n);
+  acquire(&q->lock);
+  virtio_disk_alloc(q, idx, ndesc(n, 1));
+  q->seg[idx[0]].sector = (uint64)blockno * (BSIZE / 512);
+  q->seg[idx[0]].num_sectors = nblocks * (BSIZE / 512);
+  q->seg[idx[0]].flags = 0;
+  virtio_disk_start(n, q, 0, 0, VIRTIO_BLK_T_DISCARD, idx);
+  b->disk = 1;
+  b->vq = q->id;
+  q->info[idx[0]].b = b;
+  release(&q->lock);
+  return nblocks;
 }
 
-void
-virtio_disk_intr(int n)
+// Complete the requests that the device has finished on q.
+// With EVENT_IDX, ask for an interrupt only for the next request
+// to finish after these, so that completions arriving while we
+// work through the used ring don't each interrupt.
+// Caller holds q->lock.
+static void
+virtio_disk_reap(int n, struct vq *q)
 {
-  acquire(&disk[n].vdisk_lock);
+  for(;;){
+    __sync_synchronize();
+    if(q->used_idx == q->used->id){
+      if(!disk[n].eventidx)
+        break;
+      *used_event(q) = q->used_idx;
+      __sync_synchronize();
+      if(q->used_idx == q->used->id)
+        break;
+    }
 
-  while((disk[n].used_idx % NUM) != (disk[n].used->id % NUM)){
-    int id = disk[n].used->elems[disk[n].used_idx].id;
+    int id = q->used->elems[q->used_idx % NUM].id;
 
-    if(disk[n].info[id].status != 0)
+    if(q->info[id].status != 0)
       panic("virtio_disk_intr status");
-    
-    disk[n].info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk[n].info[id].b);
 
-    disk[n].used_idx = (disk[n].used_idx + 1) % NUM;
+    struct buf *b = q->info[id].b;
+    struct buf *next;
+    q->info[id].b = 0;
+    free_chain(q, id);
+    for(; b; b = next){
+      next = b->dnext;
+      b->dnext = 0;
+      if(!q->info[id].write)
+        b->valid = 1;
+      __sync_synchronize();
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+      if(b->iodone){
+        void (*done)(struct buf*) = b->iodone;
+        b->iodone = 0;
+        done(b);
+      }
+    }
+
+    q->used_idx++;
+  }
+}
+
+static void
+latency(int how, uint64 stime)
+{
+  uint64 t = r_time() - stime;
+
+  __sync_fetch_and_add(&lat[how].n, 1);
+  __sync_fetch_and_add(&lat[how].sum, t);
+  if(t > lat[how].max)
+    lat[how].max = t;
+}
+
+// Wait for a request submitted for b to finish.
+// In polled mode, spin on b's queue for up to POLLCYCLES,
+// completing requests as the device finishes them, which
+// saves a sleep and wakeup for short requests; after that,
+// or otherwise, sleep until virtio_disk_intr() is done with b.
+// The queue's lock orders this with virtio_disk_intr().
+void
+virtio_disk_wait(int n, struct buf *b)
+{
+  struct vq *q = &disk[n].vq[b->vq];
+  int how = LINTR;
+
+  if(b->disk == 0)
+    return;
+  if(disk[n].poll){
+    how = LFALLBACK;
+    for(;;){
+      acquire(&q->lock);
+      virtio_disk_reap(n, q);
+      release(&q->lock);
+      if(b->disk == 0){
+        how = LPOLL;
+        break;
+      }
+      if(r_time() - b->stime >= POLLCYCLES)
+        break;
+    }
+  }
+
+  acquire(&q->lock);
+  while(b->disk == 1)
+    sleep(b, &q->lock);
+  release(&q->lock);
+  latency(how, b->stime);
+}
+
+// The device has one interrupt for all of its queues, so
+// whichever hart takes it completes the requests of every
+// queue, taking each queue's lock in turn.
+void
+virtio_disk_intr(int n)
+{
+  struct vq *q;
+
+  for(q = disk[n].vq; q < disk[n].vq + disk[n].nvq; q++){
+    acquire(&q->lock);
+    virtio_disk_reap(n, q);
+    release(&q->lock);
   }
+}
+
+// Turn polled completion on disk n on or off.
+// Returns whether it was on.
+int
+virtio_disk_poll(int n, int on)
+{
+  int old = disk[n].poll;
 
-  release(&disk[n].vdisk_lock);
+  disk[n].poll = on;
+  return old;
 }
 
+// Print request latencies for iostat, or reset them.
+void
+virtio_disk_stat(int show)
+{
+  int i;
+
+  for(i = 0; i < NLAT; i++){
+    if(show == 0){
+      lat[i].n = lat[i].sum = lat[i].max = 0;
+      continue;
+    }
+    printf("disk %s: requests %d avg %d max %d cycles\n", latname[i],
+           (int)lat[i].n, lat[i].n ? (int)(lat[i].sum / lat[i].n) : 0,
+           (int)lat[i].max);
+  }
+}
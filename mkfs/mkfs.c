@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = LOGBLOCKS;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,6 +40,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirlink(uint dir, char *name, uint inum);
+uint ibmap(struct dinode *din, uint fbn);
 
 // convert to intel byte order
 ushort
@@ -68,10 +70,8 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  uint rootino, inum;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -83,6 +83,10 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct xblock) <= BSIZE);
+  assert(nlog <= LOGMAX);
+  assert(sizeof(struct dirtab) == sizeof(struct dirent));
+  assert(1 + ((1<<DIRMAXDEPTH) + DTPS-1) / DTPS <= DPB);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -118,15 +122,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dirlink(rootino, ".", rootino);
+  dirlink(rootino, "..", rootino);
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -152,10 +149,7 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirlink(rootino, shortname, inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -163,13 +157,6 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
-
   balloc(freeblock);
 
   exit(0);
@@ -260,6 +247,67 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block of block fbn of the file with inode din,
+// allocating the next free block if fbn is one past the end.
+// Like bmap() in kernel/fs.c, grows the last extent if it can.
+uint
+ibmap(struct dinode *din, uint fbn)
+{
+  struct xblock xb, nxb;
+  struct extent *last;
+  uint off, x, xlast, addr;
+  int i, ni;
+
+  off = 0;
+  last = 0;
+  for(i = 0; i < NEXTENT && xint(din->ext[i].len) > 0; i++){
+    last = &din->ext[i];
+    if(fbn < off + xint(last->len))
+      return xint(last->start) + fbn - off;
+    off += xint(last->len);
+  }
+  ni = i;
+
+  xlast = 0;
+  for(x = xint(din->xaddr); x; x = xint(xb.next)){
+    rsect(x, (char*)&xb);
+    xlast = x;
+    for(i = 0; i < xint(xb.n); i++){
+      last = &xb.e[i];
+      if(fbn < off + xint(last->len))
+        return xint(last->start) + fbn - off;
+      off += xint(last->len);
+    }
+  }
+
+  assert(fbn == off);
+  addr = freeblock++;
+  if(last && xint(last->start) + xint(last->len) == addr){
+    last->len = xint(xint(last->len) + 1);
+  } else if(xlast == 0 && ni < NEXTENT){
+    din->ext[ni].start = xint(addr);
+    din->ext[ni].len = xint(1);
+  } else if(xlast && xint(xb.n) < NXEXTENT){
+    xb.e[xint(xb.n)].start = xint(addr);
+    xb.e[xint(xb.n)].len = xint(1);
+    xb.n = xint(xint(xb.n) + 1);
+  } else {
+    x = freeblock++;
+    memset(&nxb, 0, sizeof(nxb));
+    nxb.n = xint(1);
+    nxb.e[0].start = xint(addr);
+    nxb.e[0].len = xint(1);
+    wsect(x, (char*)&nxb);
+    if(xlast)
+      xb.next = xint(x);
+    else
+      din->xaddr = xint(x);
+  }
+  if(xlast)
+    wsect(xlast, (char*)&xb);
+  return addr;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -267,7 +315,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -276,22 +323,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = ibmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -303,3 +335,95 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Hash a name for the directory index.
+// Must match dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Return a pointer to slot t of a directory's table.
+ushort*
+dirtab(struct dirhead *h, uint t)
+{
+  return &((struct dirtab*)(h+1))[t/DTPS].b[t%DTPS];
+}
+
+// Add (name, inum) to the hashed directory dir.
+// Like dirlink() in kernel/fs.c, see fs.h for the format.
+void
+dirlink(uint dir, char *name, uint inum)
+{
+  struct dinode din;
+  char hbuf[BSIZE], buf[BSIZE], nbuf[BSIZE];
+  struct dirhead *h = (struct dirhead*)hbuf;
+  struct dirent *de = (struct dirent*)buf;
+  struct dirent *nde = (struct dirent*)nbuf;
+  uint hash, depth, t, fb, nfb, ld, i, j;
+
+  rinode(dir, &din);
+  if(xint(din.size) == 0){
+    memset(hbuf, 0, BSIZE);
+    h->magic = xint(DIRMAGIC);
+    *dirtab(h, 0) = xshort(1);
+    wsect(ibmap(&din, 0), hbuf);
+    wsect(ibmap(&din, 1), zeroes);
+    din.size = xint(2*BSIZE);
+  }
+  rsect(ibmap(&din, 0), hbuf);
+  assert(xint(h->magic) == DIRMAGIC);
+
+  hash = dirhash(name);
+  for(;;){
+    depth = xshort(h->depth);
+    fb = xshort(*dirtab(h, hash & ((1 << depth) - 1)));
+    rsect(ibmap(&din, fb), buf);
+    for(i = 1; i < DPB; i++)
+      if(de[i].inum == 0)
+        break;
+    if(i < DPB)
+      break;
+
+    // Split the full bucket.
+    ld = xshort(((struct dirbucket*)buf)->depth);
+    if(ld == depth){
+      assert(depth < DIRMAXDEPTH);
+      for(t = 0; t < (1 << depth); t++)
+        *dirtab(h, t + (1 << depth)) = *dirtab(h, t);
+      depth++;
+      h->depth = xshort(depth);
+    }
+    nfb = xint(din.size) / BSIZE;
+    memset(nbuf, 0, BSIZE);
+    ((struct dirbucket*)buf)->depth = xshort(ld + 1);
+    ((struct dirbucket*)nbuf)->depth = xshort(ld + 1);
+    for(i = 1, j = 1; i < DPB; i++){
+      if(dirhash(de[i].name) & (1 << ld)){
+        nde[j++] = de[i];
+        memset(&de[i], 0, sizeof(de[i]));
+      }
+    }
+    for(t = 0; t < (1 << depth); t++)
+      if(xshort(*dirtab(h, t)) == fb && (t & (1 << ld)))
+        *dirtab(h, t) = xshort(nfb);
+    wsect(ibmap(&din, fb), buf);
+    wsect(ibmap(&din, nfb), nbuf);
+    din.size = xint(xint(din.size) + BSIZE);
+  }
+
+  de[i].inum = xshort(inum);
+  strncpy(de[i].name, name, DIRSIZ);
+  wsect(ibmap(&din, fb), buf);
+  h->nent = xint(xint(h->nent) + 1);
+  wsect(ibmap(&din, 0), hbuf);
+  winode(dir, &din);
+}
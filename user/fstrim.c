@@ -0,0 +1,18 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Discard the file system's free blocks, so that the disk
+// image can give their space back to the host.
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  if((n = fstrim()) < 0){
+    fprintf(2, "fstrim: disk can't discard\n");
+    exit(1);
+  }
+  printf("fstrim: %d blocks discarded\n", n);
+  exit(0);
+}
@@ -0,0 +1,25 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Print the kernel's block I/O statistics.
+// With -z, reset them instead; with -p or -i, make waiting
+// for the disk poll for completion or sleep for the interrupt.
+int
+main(int argc, char *argv[])
+{
+  if(argc > 1 && strcmp(argv[1], "-z") == 0){
+    iostat(0);
+    exit(0);
+  }
+  if(argc > 1 && strcmp(argv[1], "-p") == 0){
+    iopoll(1);
+    exit(0);
+  }
+  if(argc > 1 && strcmp(argv[1], "-i") == 0){
+    iopoll(0);
+    exit(0);
+  }
+  iostat(1);
+  exit(0);
+}
@@ -0,0 +1,65 @@
+// Measure file system operation throughput with several
+// concurrent writers, in the style of stressfs.
+// Each writer repeatedly creates, writes, closes, and unlinks
+// its own file, so nearly all the time goes to log commits.
+// Usage: logbench [nproc [nops]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+int
+main(int argc, char *argv[])
+{
+  int nproc = 4, nops = 100;
+  int fd, i, pid, start, ticks;
+  char path[] = "logbench0";
+  char data[512];
+
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+  if(argc > 2)
+    nops = atoi(argv[2]);
+  if(nproc < 1 || nproc > 10 || nops < 1){
+    fprintf(2, "usage: logbench [nproc [nops]]\n");
+    exit(1);
+  }
+
+  memset(data, 'a', sizeof(data));
+  start = uptime();
+
+  for(pid = 0; pid < nproc; pid++){
+    if(fork() == 0){
+      path[8] += pid;
+      for(i = 0; i < nops; i++){
+        fd = open(path, O_CREATE | O_RDWR);
+        if(fd < 0){
+          fprintf(2, "logbench: create %s failed\n", path);
+          exit(1);
+        }
+        if(write(fd, data, sizeof(data)) != sizeof(data)){
+          fprintf(2, "logbench: write %s failed\n", path);
+          exit(1);
+        }
+        close(fd);
+        if(unlink(path) < 0){
+          fprintf(2, "logbench: unlink %s failed\n", path);
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+  for(pid = 0; pid < nproc; pid++)
+    wait(0);
+
+  ticks = uptime() - start;
+  if(ticks < 1)
+    ticks = 1;
+  // a tick is about 1/10th second in qemu (see start.c).
+  printf("logbench: %d procs, %d ops in %d ticks, %d ops/sec\n",
+         nproc, nproc*nops, ticks, nproc*nops*10/ticks);
+  exit(0);
+}
@@ -24,6 +24,11 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int ntas();
+int iostat(int);
+int fsync(int);
+int fdatasync(int);
+int iopoll(int);
+int fstrim(void);
 int crash(const char*, int);
 int mount(char*, char *);
 int umount(char*);
@@ -136,6 +136,163 @@ opentest(char *s)
   }
 }
 
+// fsync() and fdatasync() work on files and fail on pipes.
+void
+fsynctest(char *s)
+{
+  int fd, fds[2];
+
+  fd = open("fsync", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create fsync failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "x", 1) != 1){
+    printf("%s: write fsync failed\n", s);
+    exit(1);
+  }
+  if(fsync(fd) != 0 || fdatasync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf("%s: fsync of closed fd succeeded\n", s);
+    exit(1);
+  }
+  if(unlink("fsync") < 0){
+    printf("%s: unlink fsync failed\n", s);
+    exit(1);
+  }
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync of pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// write and read back a file with the disk in polled mode.
+void
+iopolltest(char *s)
+{
+  enum { N=20 };
+  char buf[BSIZE];
+  int fd, i, old;
+
+  old = iopoll(1);
+  if(iopoll(1) != 1){
+    printf("%s: iopoll didn't turn polling on\n", s);
+    exit(1);
+  }
+  fd = open("iopoll", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create iopoll failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write iopoll failed\n", s);
+      exit(1);
+    }
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync iopoll failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("iopoll", O_RDONLY);
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != 'a' + i ||
+       buf[sizeof(buf)-1] != 'a' + i){
+      printf("%s: read iopoll wrong\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("iopoll");
+  iopoll(old);
+}
+
+// Commit the open transaction.
+void
+fstrimsync(void)
+{
+  int fd;
+
+  fd = open(".", O_RDONLY);
+  fsync(fd);
+  close(fd);
+}
+
+// Write an n-block file, commit it, and unlink it, committing
+// the unlink too if sync is set.
+void
+fstrimfile(char *s, int n, int sync)
+{
+  char buf[BSIZE];
+  int fd, i;
+
+  fd = open("fstrim", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create fstrim failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+  for(i = 0; i < n; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write fstrim failed\n", s);
+      exit(1);
+    }
+  }
+  fsync(fd);
+  close(fd);
+  if(unlink("fstrim") < 0){
+    printf("%s: unlink fstrim failed\n", s);
+    exit(1);
+  }
+  if(sync)
+    fstrimsync();
+}
+
+// free some blocks, commit the frees, and trim; frees that
+// haven't committed must not be trimmed.
+void
+fstrimtest(char *s)
+{
+  enum { N=20 };
+  int n1, n2, n3;
+
+  fstrimfile(s, N, 1);
+  if((n1 = fstrim()) < 0){
+    printf("%s: disk can't discard, skipping\n", s);
+    return;
+  }
+  if(n1 < N){
+    printf("%s: fstrim discarded %d blocks, expected %d\n", s, n1, N);
+    exit(1);
+  }
+
+  // the unlink hasn't committed, so fstrim must leave the
+  // file's blocks alone.
+  fstrimfile(s, N, 0);
+  if((n2 = fstrim()) < 0 || n2 > n1 - N){
+    printf("%s: fstrim discarded %d blocks of uncommitted frees\n", s, n2);
+    exit(1);
+  }
+
+  fstrimsync();
+  if((n3 = fstrim()) < n2 + N){
+    printf("%s: fstrim discarded %d blocks, expected %d\n", s, n3, n2 + N);
+    exit(1);
+  }
+}
+
 void
 writetest(char *s)
 {
@@ -1124,6 +1281,88 @@ bigdir(char *s)
   }
 }
 
+// fill a directory past one bucket, so that it splits, and
+// check that lookups and unlinks still find every entry.
+void
+dirsplittest(char *s)
+{
+  enum { N = 3*(BSIZE/sizeof(struct dirent)) };
+  struct dirent de;
+  char name[10], c;
+  int i, fd, n;
+
+  if(mkdir("ds") != 0){
+    printf("%s: mkdir ds failed\n", s);
+    exit(1);
+  }
+  name[0] = 'd';
+  name[1] = 's';
+  name[2] = '/';
+  name[6] = '\0';
+  for(i = 0; i < N; i++){
+    name[3] = '0' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    fd = open(name, O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    c = i;
+    write(fd, &c, 1);
+    close(fd);
+  }
+
+  // every entry, and only those, shows up when ds is read.
+  fd = open("ds", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de))
+    if(de.inum != 0)
+      n++;
+  close(fd);
+  if(n != N + 2){
+    printf("%s: ds has %d entries, expected %d\n", s, n, N + 2);
+    exit(1);
+  }
+
+  for(i = 0; i < N; i++){
+    name[3] = '0' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    if(i % 2 == 0 && unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[3] = '0' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    fd = open(name, O_RDONLY);
+    if(i % 2 == 0){
+      if(fd >= 0){
+        printf("%s: open unlinked %s succeeded\n", s, name);
+        exit(1);
+      }
+      continue;
+    }
+    if(fd < 0 || read(fd, &c, 1) != 1 || c != (char)i){
+      printf("%s: lookup %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  if(unlink("ds") != 0){
+    printf("%s: unlink ds failed\n", s);
+    exit(1);
+  }
+}
+
 void
 subdir(char *s)
 {
@@ -2155,6 +2394,9 @@ main(int argc, char *argv[])
     {stacktest, "stacktest"},
     {opentest, "opentest"},
     {writetest, "writetest"},
+    {fsynctest, "fsynctest"},
+    {iopolltest, "iopolltest"},
+    {fstrimtest, "fstrimtest"},
     {writebig, "writebig"},
     {createtest, "createtest"},
     {openiputtest, "openiput"},
@@ -2171,6 +2413,7 @@ main(int argc, char *argv[])
     {iref, "iref"},
     {forktest, "forktest"},
     {bigdir, "bigdir"}, // slow
+    {dirsplittest, "dirsplittest"},
     { 0, 0},
   };
     
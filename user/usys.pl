@@ -37,3 +37,8 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("ntas");
+entry("iostat");
+entry("fsync");
+entry("fdatasync");
+entry("iopoll");
+entry("fstrim");